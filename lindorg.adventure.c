@@ -2,17 +2,63 @@
  NAME: lindorg.adventure.c
 
  SYNOPSIS:  To compile program ...
-    gcc -o lindorg.adventure lindorg.adventure.c -lpthread
+    gcc -o lindorg.adventure lindorg.adventure.c -lpthread -lrt
+
+    To run the program ...
+    lindorg.adventure [-m] [-w] [-o] [-M metrics]
+    lindorg.adventure -r [-q] [-m] [-w] [-o] [-M metrics] [script ...]
+    lindorg.adventure -l socket [-u] [-m] [-w] [-o] [-M metrics]
+    lindorg.adventure -s [-M metrics] [map or directory of maps ...]
+    lindorg.adventure -c
 
  DESCRIPTION:
     This program simulates a text base adventure game where a user is placed in a starting location,
     and the user must find the "end room".
-    The program uses concurrency to display to the user current local time.
+    The program uses concurrency to display to the user current local time: a time thread
+    runs for the whole game and keeps the formatted time in memory, where the "time" command
+    reads it.  With -w the time thread also writes it to "currentTime.txt" on each request.
+    With -o the game ends with a score: the moves of a shortest path (found by a breadth first
+    search) against the moves the player took.  -s plays no game and prints the shortest path of
+    each map named instead (of the newest map if none is), then a summary line.
+    -r replays command scripts (one command per line, "-" or none for standard input), one game
+    per script on the same map, for load tests.  The output is collected in one large buffer,
+    or discarded with -q, and the turns played per second are reported on standard error.
+    -l serves games on a Unix domain socket instead: the map is loaded once and shared by every
+    session, and one epoll loop plays the lines each client sends, one turn per line, until
+    SIGINT or SIGTERM.  A session only holds its current room, its path and its unsent output.
+    With -u the server also watches the working directory with inotify: when a new map is
+    published it is loaded by a background thread and swapped in between two epoll wake ups.
+    New sessions play the new map; a session keeps the map it started on until it ends, and
+    a replaced map is freed when its last session ends.  A new map that cannot be loaded
+    is reported and counted in the metrics, and the server keeps playing the map it has.
+    A map directory holding a binary "rooms.map" file (lindorg.buildrooms -b) is mapped
+    into memory and played in place; otherwise the room files are read and parsed in place
+    by a pool of loader threads into an image with the same layout.  Loading a map file only
+    checks its header, its sections and its names; each room is checked when it is first
+    looked up, as its menu is rendered (or by the solver before its search).
+    The menu of every room is rendered once after loading, so a turn only copies its menu
+    out and each turn's output is sent with one write (one writev on the socket).
+    With -m the map is shared between game processes: the first to load it publishes its
+    image and name index as a read only POSIX shared memory segment, which holds offsets
+    and room indices only, and later processes attach to it in constant time instead of
+    loading, sharing its pages.  A segment stays in /dev/shm until it is unlinked: the
+    server (-u) unlinks the segment of a map it has replaced, and -c unlinks every segment
+    of the user's.  Processes attached to a segment that is unlinked keep playing it; its
+    memory is freed when the last of them detaches, and the next process to load that map
+    publishes it again.
+    -M keeps runtime metrics and writes them to the file named, in the Prometheus text
+    format, on exit and whenever the program gets SIGUSR1: latency histograms of finding
+    and loading the map, of waiting for and playing a turn, of room lookups and of time
+    requests, with counts of turns, invalid inputs, games and sessions and the size of the
+    map.  The file is replaced by rename, so a scraper never reads half of it.
+    The newest map is the one the lindorg.rooms.latest link (kept by lindorg.buildrooms)
+    points at; without a usable link the working directory is scanned for it.
  AUTHOR:  Gerson Lindor Jr. (lindorg@oregonstate.edu)
  DATE CREATED: February 8, 2020
  LAST MODIFIED: February 9, 2020
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -23,151 +69,662 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <pthread.h>
-
-
-#define SELECTED 7
-#define NAME_SZ 9
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <signal.h>
+
+
+#define NAME_SZ 32
 #define CONN_SZ 6
 #define STR 200
+#define MAP_FILENAME "rooms.map"
+#define MAP_MAGIC "LNDGMAP"
+#define MAP_VERSION 1
+#define LATEST_LINK "lindorg.rooms.latest"
+#define LOAD_FILES 1024
+#define PATH_CHUNK 65536
+#define REPLAY_BUFFER (1 << 20)
+#define SERVER_EVENTS 256
+#define PROMPT_TEXT "WHERE TO? >"
+#define HUH_TEXT "\nHUH? I DON'T UNDERSTAND THAT ROOM. TRY AGAIN.\n\n"
+#define LATENCY_BUCKETS 10
+
 
+enum roomType { MID_ROOM, START_ROOM, END_ROOM };
 
-struct room {
-    char *name;
-    int connectCount;
-    char **connections;
-    char *roomType;
+/*
+ An open addressing hash index from room name to room index.  mask + 1 is the
+ (power of two) number of slots; empty slots hold -1.
+*/
+struct nameIndex {
+    unsigned int mask;
+    int32_t *slots;
 };
 
+/*
+ A loaded map, held the way a binary map file lays it out (struct mapHeader):
+ a room is an index into the types, names (offsets into strings) and rows
+ (CSR offsets into edges) arrays, so nothing in a map is a pointer.  The
+ arrays are sections of image: the mapped map file or shared segment (mapped
+ set), or an image built from room files.  menuText holds the menu of every
+ room, rendered once, from the offsets in menuRows (roomCount + 1 of them).
+ The name index and the menus are allocated (ownTables set) unless a shared
+ segment holds them; segmentName then names it, and is empty otherwise.
+*/
+struct world {
+    int roomCount;
+    int startRoom;
+    int endRoom;
+    unsigned char *types;
+    uint32_t *names;
+    uint32_t *rows;
+    int32_t *edges;
+    char *strings;
+    struct nameIndex index;
+    uint64_t *menuRows;
+    char *menuText;
+    char *image;
+    size_t imageSize;
+    int mapped;
+    int ownTables;
+    char segmentName[STR];
+};
 
+/*
+ One loader thread's share of a directory of room files: files first to
+ last - 1 of the listing are read into text and parsed in place.  Room names
+ and types wait in roomNames and roomKinds, and connection names in links
+ (firstLink holds each room's first), until the image is laid out; the slice
+ then copies them in, its names from stringBase and its edges from linkBase.
+*/
+struct loadSlice {
+    struct world *aWorld;
+    int directoryFd;
+    char *fileNames;
+    size_t *nameStarts;
+    int first;
+    int last;
+    char *text;
+    char **roomNames;
+    unsigned char *roomKinds;
+    char **links;
+    size_t *firstLink;
+    size_t linkCount;
+    size_t linkBase;
+    size_t stringSize;
+    size_t stringBase;
+    int startRoom;
+    int endRoom;
+    int failed;
+};
 
-struct room **makeRoomList();
-void destroyList(struct room **list);
-void createFileName(char *fileName, char *directoryName);
-char *getString(char *data);
-char *getData(char *line);
-void readOneRoom(FILE *reader,struct room *aRoom, char *line);
-char *openDirectory();
-void readDirectory (char *directoryName, struct room **list);
-void readFile(char *directoryName, char *fileName, struct room *aRoom);
-void countAllConnections (struct room **list);
-void displayRoom(FILE *stream,struct room *aRoom);
-int searchRooms(struct room **list, char *item, int section);
-int searchConnections(struct room *aRoom, char *item);
-void mainMenu(struct room *aRoom);
-int checkInput(struct room **list, struct room *aRoom, char *response);
-int prompt(struct room **list, int index, int showMenu);
-void *getTime(void *argument);
-void showLineFromFile(char *filename);
+/*
+ Command line options of the game.
+*/
+struct settings {
+    int writeTime;
+    int score;
+    int solve;
+    int replay;
+    int quiet;
+    char *socketPath;
+    int shared;
+    char *metricsPath;
+    int reload;
+    int clean;
+};
 
+/*
+ Shortest paths seen by the solver: how many maps were solved, not solved and
+ could not be loaded, and the fewest, most and total moves of their shortest
+ paths.
+*/
+struct solveTally {
+    int solved;
+    int unsolvable;
+    int damaged;
+    int shortest;
+    int longest;
+    long totalMoves;
+};
+
+/*
+ The time service.  Its thread keeps theTime formatted for the current
+ minute, waking at each minute boundary, and writes it to currentTime.txt when
+ writeFile is set.  The game reads theTime under lock, so a "time" command
+ waits for no thread and no file.
+*/
+struct timeService {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char theTime[STR];
+    time_t minute;
+    int writeFile;
+    int stop;
+};
 
-pthread_mutex_t myMutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ The rooms the player moved to, as room indices.  Steps collect in a buffer
+ that grows to PATH_CHUNK entries; after that every full buffer is spilled to
+ a replay file (an anonymous temporary file), so memory stays bounded however
+ long the game runs.
+*/
+struct pathLog {
+    int32_t *steps;
+    int used;
+    int capacity;
+    long stepCount;
+    FILE *replay;
+};
 
+/*
+ One map the server has played, read copy update style.  Sessions read the
+ version they started on and are counted in readers; a version replaced by a
+ newer map is retired, and freed once it has no readers left.  epoch numbers
+ the versions in the order they were served.
+*/
+struct mapVersion {
+    struct world aWorld;
+    char *directoryName;
+    long epoch;
+    int readers;
+    int retired;
+};
 
-int main() {
-    char *directoryName = NULL;
-    struct room **list = NULL;
-    int start = -1, end = -1, result = -1;
-    char *victoryPath[1000];
-    int vStep = 0, previousRoom = -1;
-    int resultCode = -1;
-    pthread_t myThreadID;
+/*
+ A game played over the server's socket: the map version it plays, the room
+ the player is in, the path so far, the input not yet played and the output
+ the socket has not taken.  Sessions are kept in a doubly linked list so the
+ server can end them all.
+*/
+struct session {
+    int fd;
+    struct mapVersion *map;
+    int room;
+    struct pathLog path;
+    char input[STR];
+    int inputUsed;
+    char *pending;
+    size_t pendingSize;
+    size_t pendingSent;
+    int finished;
+    int hungUp;
+    struct session *previous;
+    struct session *next;
+};
+
+/*
+ The game server: the map version new sessions start on and the time service,
+ the epoll instance, the memory stream a turn's output is rendered into (text,
+ textSize) and the open sessions, with counts of the sessions and turns
+ served.  With -u, watchFd is the inotify instance watching for new maps and
+ the loader thread (loading set) leaves the version it loaded in loaded and
+ signals reloadFd; reloadPending asks for another load once it is done.  The
+ loader remembers the last map it could not load in rejected, so later events
+ do not load it again.
+*/
+struct server {
+    struct mapVersion *current;
+    struct settings *options;
+    struct timeService *timeKeeper;
+    int epollFd;
+    int watchFd;
+    int reloadFd;
+    pthread_t loader;
+    int loading;
+    int reloadPending;
+    struct mapVersion *loaded;
+    char *rejected;
+    FILE *out;
+    char *text;
+    size_t textSize;
+    struct session *sessions;
+    int openSessions;
+    long sessionCount;
+    long turns;
+};
+
+/*
+ A latency histogram: counts[i] observations took at most latencyBounds[i]
+ seconds and more than the bound before it (the last bucket has no bound),
+ sumNanos is their total.
+*/
+struct histogram {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long long sumNanos;
+};
+
+/*
+ Runtime metrics, kept while path names the file they are exported to (-M).
+ The game updates them with relaxed atomics; the metrics thread writes them
+ out on SIGUSR1 and once more when stop is set.  rooms, edges and mapBytes
+ describe the map loaded last.
+*/
+struct metrics {
+    char *path;
+    pthread_t thread;
+    int stop;
+    struct histogram openSeconds;
+    struct histogram loadSeconds;
+    struct histogram waitSeconds;
+    struct histogram turnSeconds;
+    struct histogram lookupSeconds;
+    struct histogram timeSeconds;
+    unsigned long turns;
+    unsigned long invalidInputs;
+    unsigned long timeRequests;
+    unsigned long games;
+    unsigned long wins;
+    unsigned long sessions;
+    unsigned long reloads;
+    unsigned long reloadFailures;
+    unsigned long rooms;
+    unsigned long edges;
+    unsigned long mapBytes;
+};
+
+/*
+ Header of a binary map file, written by lindorg.buildrooms with the same
+ layout.  Offsets are from the start of the file and 8 byte aligned.  The
+ sections are:
+    types    roomCount bytes: 0 MID_ROOM, 1 START_ROOM, 2 END_ROOM
+    names    roomCount uint32 offsets into strings
+    rows     roomCount + 1 uint32 CSR offsets into edges
+    edges    edgeCount int32 room indices
+    strings  stringSize bytes of NUL terminated room names
+*/
+struct mapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t roomCount;
+    uint32_t edgeCount;
+    int32_t startRoom;
+    int32_t endRoom;
+    uint32_t stringSize;
+    uint64_t typeOffset;
+    uint64_t nameOffset;
+    uint64_t rowOffset;
+    uint64_t edgeOffset;
+    uint64_t stringOffset;
+    uint64_t fileSize;
+};
+
+static char *roomTypes[3] = { "MID_ROOM", "START_ROOM", "END_ROOM" };
 
+static const double latencyBounds[LATENCY_BUCKETS - 1] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2,
+                                                           0.1, 1.0, 10.0, 100.0 };
 
+
+
+char *openDirectory();
+char *readLatestLink();
+int readDirectory(char *directoryName, struct world *aWorld);
+int countLoadThreads(int fileCount);
+void runSlices(struct loadSlice *slices, int sliceCount, void *(*body)(void *));
+void *readSlice(void *argument);
+int parseRoomFiles(struct loadSlice *slice, size_t *starts);
+void *copySlice(void *argument);
+void *resolveSlice(void *argument);
+int slicesFailed(struct loadSlice *slices, int sliceCount);
+ssize_t readAll(int fd, char *data, size_t size);
+int makeImage(struct world *aWorld, int roomCount, size_t edgeCount, size_t stringSize);
+void pointSections(struct world *aWorld);
+uint64_t alignOffset(uint64_t offset);
+char *roomName(struct world *aWorld, int room);
+void displayRoom(FILE *stream, struct world *aWorld, int room);
+int searchConnections(struct world *aWorld, int room, int item);
+void makeNameIndex(struct world *aWorld);
+unsigned int indexCapacity(int roomCount);
+int findRoom(struct world *aWorld, char *name);
+unsigned int hashName(char *name);
+void mainMenu(FILE *stream, struct world *aWorld, int room);
+int makeMenus(struct world *aWorld);
+int checkRoom(struct world *aWorld, int room);
+int checkRooms(struct world *aWorld);
+size_t renderMenu(struct world *aWorld, int room, char *menu);
+size_t appendText(char *buffer, size_t used, char *text);
+int checkInput(struct world *aWorld, int room, char *response);
+int prompt(struct world *aWorld, int index, int showMenu, FILE *input, long *turns, int flush);
+int loadWorld(char *directoryName, struct world *aWorld);
+int loadMapFile(char *directoryName, struct world *aWorld);
+int parseRoomType(char *value);
+int checkMapHeader(struct mapHeader *header, size_t mapSize);
+void destroyWorld(struct world *aWorld);
+int loadSharedWorld(char *directoryName, struct world *aWorld);
+int nameSegment(char *directoryName, char *segmentName);
+int attachSegment(char *segmentName, struct world *aWorld);
+int publishSegment(struct world *aWorld, char *segmentName);
+int removeSegments(void);
+int parseOptions(int argc, char *argv[], struct settings *options);
+void startTimeService(struct timeService *service);
+void stopTimeService(struct timeService *service);
+void *runTimeService(void *argument);
+void showTime(FILE *stream, struct timeService *service, int writeFile);
+void formatTime(time_t aTime, char *theTime);
+void writeTimeFile(char *theTime);
+void initPath(struct pathLog *path);
+void recordStep(struct pathLog *path, int room);
+void printPath(FILE *stream, struct pathLog *path, struct world *aWorld);
+void destroyPath(struct pathLog *path);
+int shortestPath(struct world *aWorld, int *previous);
+int solveMap(char *directoryName);
+void tallyMap(struct solveTally *tally, char *directoryName);
+int solveMaps(int nameCount, char *names[]);
+void scoreGame(FILE *stream, struct world *aWorld, long stepCount);
+int playGame(struct world *aWorld, struct settings *options, struct timeService *timeKeeper,
+             FILE *input, long *turns);
+int replayScripts(struct world *aWorld, struct settings *options, struct timeService *timeKeeper,
+                  int scriptCount, char *scripts[]);
+void showVictory(FILE *stream, struct world *aWorld, struct settings *options, struct pathLog *path);
+double readClock(void);
+int runServer(struct world *aWorld, char *directoryName, struct settings *options,
+              struct timeService *timeKeeper);
+void stopServer(int signalNumber);
+int openListener(char *socketPath);
+struct mapVersion *makeVersion(struct world *aWorld, char *directoryName, long epoch);
+void releaseVersion(struct mapVersion *version);
+void watchMaps(struct server *aServer);
+void readMapEvents(struct server *aServer);
+void startReload(struct server *aServer);
+void *loadNewMap(void *argument);
+void swapMap(struct server *aServer);
+void acceptSessions(struct server *aServer, int listener);
+void readSession(struct server *aServer, struct session *aSession);
+int playLines(struct server *aServer, struct session *aSession);
+int playTurn(struct server *aServer, struct session *aSession, char *command);
+int sendOutput(struct server *aServer, struct session *aSession, int menuRoom);
+void flushSession(struct server *aServer, struct session *aSession);
+void watchSession(struct server *aServer, struct session *aSession, uint32_t events);
+void endSession(struct server *aServer, struct session *aSession);
+void startMetrics(char *path);
+void stopMetrics(void);
+void *runMetrics(void *argument);
+double startTimer(void);
+double stopTimer(struct histogram *latency, double started);
+void countMetric(unsigned long *counter);
+void setMapMetrics(struct world *aWorld);
+void writeMetrics(void);
+void writeCounter(FILE *stream, char *name, char *type, char *help, unsigned long value);
+void writeHistogram(FILE *stream, char *name, char *help, struct histogram *latency);
+
+
+static volatile sig_atomic_t serverStopping = 0;
+
+/* the metrics of the whole program, whatever thread records them */
+static struct metrics gameMetrics;
+
+
+int main(int argc, char *argv[]) {
+    char *directoryName = NULL;
+    struct world aWorld;
+    struct settings options;
+    struct timeService timeKeeper;
+    long turns = 0;
+    int flag;
+    double started;
+
+
+    if (parseOptions(argc, argv, &options) == 0) {
+        fprintf(stderr, "usage: %s [-m] [-w] [-o] [-M metrics]"
+                        " | -r [-q] [-m] [-w] [-o] [-M metrics] [script ...]"
+                        " | -l socket [-u] [-m] [-w] [-o] [-M metrics]"
+                        " | -s [-M metrics] [map or directory of maps ...] | -c\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options.clean) {
+        return removeSegments() ? 0 : EXIT_FAILURE;
+    }
+    /* before any other thread starts, so they all leave SIGUSR1 to it */
+    if (options.metricsPath) {
+        startMetrics(options.metricsPath);
+    }
+    if (options.solve) {
+        flag = solveMaps(argc - optind, argv + optind);
+        stopMetrics();
+        return flag ? 0 : EXIT_FAILURE;
+    }
     /* set up the game */
-    list = makeRoomList();
+    started = startTimer();
     directoryName = openDirectory();
-    readDirectory(directoryName, list);
+    stopTimer(&gameMetrics.openSeconds, started);
+    if (!directoryName) {
+        fprintf(stderr, "Unable to find a lindorg.rooms directory\n");
+        exit(EXIT_FAILURE);
+    }
+    started = startTimer();
+    if (options.shared) {
+        flag = loadSharedWorld(directoryName, &aWorld);
+    } else {
+        flag = loadWorld(directoryName, &aWorld);
+        if (flag && makeMenus(&aWorld) == 0) {
+            fprintf(stderr, "Map in %s is damaged\n", directoryName);
+            destroyWorld(&aWorld);
+            flag = 0;
+        }
+    }
+    if (flag == 0) {
+        exit(EXIT_FAILURE);
+    }
+    stopTimer(&gameMetrics.loadSeconds, started);
+    setMapMetrics(&aWorld);
     /* interact with user */
-    /* main mutex lock*/
-    pthread_mutex_lock(&myMutex);
-    /* create second thread */
-    resultCode = pthread_create(&myThreadID, NULL, getTime, NULL);
+    /* the time thread runs until the game ends */
+    startTimeService(&timeKeeper);
+    if (options.socketPath) {
+        /* the server takes the world over, leaving aWorld empty */
+        flag = runServer(&aWorld, directoryName, &options, &timeKeeper);
+    } else if (options.replay) {
+        flag = replayScripts(&aWorld, &options, &timeKeeper, argc - optind, argv + optind);
+    } else {
+        /* a turn's output goes out in one write, flushed before each read */
+        setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+        flag = playGame(&aWorld, &options, &timeKeeper, stdin, &turns);
+    }
+    stopTimeService(&timeKeeper);
+    if (directoryName) { free(directoryName); directoryName = NULL; }
+    destroyWorld(&aWorld);
+    stopMetrics();
+    return flag ? 0 : EXIT_FAILURE;
+}
+
+
+/*
+Reads the command line options.
+Returns 1 if the options are valid, otherwise returns 0.
+*/
+int parseOptions(int argc, char *argv[], struct settings *options) {
+    int option;
+
+    options->writeTime = 0;
+    options->score = 0;
+    options->solve = 0;
+    options->replay = 0;
+    options->quiet = 0;
+    options->socketPath = NULL;
+    options->shared = 0;
+    options->metricsPath = NULL;
+    options->reload = 0;
+    options->clean = 0;
+    while ((option = getopt(argc, argv, "wosrqmucl:M:")) != -1) {
+        switch (option) {
+            case 'w':
+                options->writeTime = 1;
+                break;
+            case 'o':
+                options->score = 1;
+                break;
+            case 's':
+                options->solve = 1;
+                break;
+            case 'r':
+                options->replay = 1;
+                break;
+            case 'q':
+                options->quiet = 1;
+                break;
+            case 'l':
+                options->socketPath = optarg;
+                break;
+            case 'm':
+                options->shared = 1;
+                break;
+            case 'u':
+                options->reload = 1;
+                break;
+            case 'c':
+                options->clean = 1;
+                break;
+            case 'M':
+                options->metricsPath = optarg;
+                break;
+            default:
+                return 0;
+        }
+    }
+    if (options->solve + options->replay + (options->socketPath != NULL) > 1
+        || (options->quiet && !options->replay) || (options->shared && options->solve)
+        || (options->reload && !options->socketPath) || (options->clean && argc != 2)) {
+        return 0;
+    }
+    /* only the solver takes map names, and only replays take scripts */
+    return optind == argc || options->solve || options->replay;
+}
+
+
+/*
+Starts the time service with the current time already formatted.
+*/
+void startTimeService(struct timeService *service) {
+    int resultCode;
+
+    pthread_mutex_init(&service->lock, NULL);
+    pthread_cond_init(&service->wake, NULL);
+    service->minute = time(NULL) / 60;
+    formatTime(service->minute * 60, service->theTime);
+    service->writeFile = 0;
+    service->stop = 0;
+    resultCode = pthread_create(&service->thread, NULL, runTimeService, service);
     assert(0 == resultCode);
-    /* find start room */
-    start = searchRooms(list, "N/A", 0);
-    /* find end room */
-    end = searchRooms(list, "N/A", 1);
-    do {
-    /* prompt user */
-        previousRoom = start;
-        result = prompt(list, start, 1);
-        /* when time is called, stay in the same room */
-        if (result == SELECTED) {
-            do {
-                 /* main mutex unlock */
-                pthread_mutex_unlock(&myMutex);
-                 /* use pthread join to block until second thread completes */
-                 resultCode = pthread_join(myThreadID, NULL);
-                assert(0 == resultCode);
-                /* main mutex lock */
-                pthread_mutex_lock(&myMutex);
-                /* recreate the second thread */
-                resultCode = pthread_create( &myThreadID, NULL, getTime, NULL);
-                showLineFromFile("currentTime.txt");
-                result = previousRoom; 
-                result = prompt(list, result, 0);
-            } while (result == SELECTED); /* if the user selects "time" repetitively */
+}
+
+
+/*
+Stops the time thread, once it has written any requested file, and waits
+for it.
+*/
+void stopTimeService(struct timeService *service) {
+    int resultCode;
+
+    pthread_mutex_lock(&service->lock);
+    service->stop = 1;
+    pthread_cond_signal(&service->wake);
+    pthread_mutex_unlock(&service->lock);
+    resultCode = pthread_join(service->thread, NULL);
+    assert(0 == resultCode);
+    pthread_cond_destroy(&service->wake);
+    pthread_mutex_destroy(&service->lock);
+}
+
+
+/*
+Thread body of the time service: sleeps until the next minute or until the
+game wakes it, then refreshes theTime and writes the requested file.  The
+file is written outside the lock.
+*/
+void *runTimeService(void *argument) {
+    struct timeService *service = (struct timeService *)argument;
+    struct timespec deadline;
+    char theTime[STR];
+    time_t now;
+
+    pthread_mutex_lock(&service->lock);
+    while (1) {
+        now = time(NULL);
+        if (now / 60 != service->minute) {
+            service->minute = now / 60;
+            formatTime(now, service->theTime);
         }
-        start = result;
-        if (result != previousRoom) { 
-            victoryPath[vStep] = list[result]->name;
-            ++vStep;
+        if (service->writeFile) {
+            service->writeFile = 0;
+            memcpy(theTime, service->theTime, STR);
+            pthread_mutex_unlock(&service->lock);
+            writeTimeFile(theTime);
+            pthread_mutex_lock(&service->lock);
+            continue;
         }
-    } while (start != end);
-    /* victory message */
-    printf("YOU HAVE FOUND THE END ROOM. CONGRATULATIONS!\n");
-    printf("YOU TOOK %d STEPS. YOUR PATH TO VICTORY WAS: \n", vStep);
-    int i;
-    for(i = 0; i < vStep; ++i) {
-        printf("%s\n", victoryPath[i]);
+        if (service->stop) {
+            break;
+        }
+        deadline.tv_sec = (service->minute + 1) * 60;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&service->wake, &service->lock, &deadline);
     }
-    if (directoryName) { free(directoryName); directoryName = NULL; }
-    destroyList(list);
-    return 0;
+    pthread_mutex_unlock(&service->lock);
+    return NULL;
 }
 
 
 /*
-Reads the first line of a file and outputs the content
+Outputs the current time kept by the time service.  The time is formatted on
+the spot if the thread has not yet caught up with a new minute.  With
+writeFile the time thread is asked to write currentTime.txt as well.
 */
-void showLineFromFile(char *filename) {
-    FILE *reader;
+void showTime(FILE *stream, struct timeService *service, int writeFile) {
     char theTime[STR];
-
-    memset(theTime, '\0', STR);
-    reader = fopen(filename, "r");
-    if (reader) {
-        fgets(theTime, STR, reader);
+    time_t now = time(NULL);
+    double started = startTimer();
+
+    countMetric(&gameMetrics.timeRequests);
+    pthread_mutex_lock(&service->lock);
+    if (now / 60 != service->minute) {
+        service->minute = now / 60;
+        formatTime(now, service->theTime);
     }
-    fclose(reader);
-    printf("\n%s\n\n", theTime);
+    memcpy(theTime, service->theTime, STR);
+    if (writeFile) {
+        service->writeFile = 1;
+        pthread_cond_signal(&service->wake);
+    }
+    pthread_mutex_unlock(&service->lock);
+    /* as the line read back from currentTime.txt did, with its newline */
+    fprintf(stream, "\n%s\n\n\n", theTime);
+    stopTimer(&gameMetrics.timeSeconds, started);
 }
 
 
 /*
-Writes the local time to a file name "currentTime.txt"
+Formats a time as local time, e.g. "01:05pm, Monday, February 10, 2020".
 */
-void *getTime(void *argument) {
-    char filename [] = "currentTime.txt";
-    FILE *afile;
-    time_t aTime;
-    struct tm *tmp;
-    char theTime[STR];
+void formatTime(time_t aTime, char *theTime) {
+    struct tm when;
 
-    /* mutext lock in the 2nd thread */
-    pthread_mutex_lock(&myMutex);
-    /* get local time */
-    aTime = time(NULL);
-    tmp = localtime(&aTime);
-    if(!tmp) {
+    if (!localtime_r(&aTime, &when)) {
         fprintf(stderr, "local time error\n");
         exit(EXIT_FAILURE);
     }
-    if(strftime(theTime, STR, "%I:%M%P, %A, %B %d, %Y", tmp) == 0) {
+    if (strftime(theTime, STR, "%I:%M%P, %A, %B %d, %Y", &when) == 0) {
         fprintf(stderr, "Error time is undefined\n");
         exit(EXIT_FAILURE);
     }
-    /* write to file */
+}
+
+
+/*
+Writes a formatted time to a file name "currentTime.txt"
+*/
+void writeTimeFile(char *theTime) {
+    char filename [] = "currentTime.txt";
+    FILE *afile;
+
     afile = fopen(filename, "w");
     if (afile) {
         /* write time to a file */
@@ -177,60 +734,1432 @@ void *getTime(void *argument) {
         exit(EXIT_FAILURE);
     }
     fclose(afile);
-    /* unlock the mutext */
-    pthread_mutex_unlock(&myMutex);
-    return NULL;
 }
 
 /*
-Prompts the user make a selection via a menu selection display.
-Returns the index of the selected rooms.
-If the user selects "time", the prompt returns the size of the list.
+Starts an empty path log with a small buffer.
+*/
+void initPath(struct pathLog *path) {
+    path->capacity = 64;
+    path->steps = (int32_t *)malloc(path->capacity * sizeof(int32_t));
+    assert(path->steps != 0);
+    path->used = 0;
+    path->stepCount = 0;
+    path->replay = NULL;
+}
+
+
+/*
+Adds a room to the path.  The buffer doubles up to PATH_CHUNK steps; a full
+buffer of that size is appended to the replay file in one write.
+*/
+void recordStep(struct pathLog *path, int room) {
+    if (path->used == path->capacity) {
+        if (path->capacity < PATH_CHUNK) {
+            path->capacity *= 2;
+            path->steps = (int32_t *)realloc(path->steps, path->capacity * sizeof(int32_t));
+            assert(path->steps != 0);
+        } else {
+            if (!path->replay) {
+                path->replay = tmpfile();
+                if (!path->replay) {
+                    fprintf(stderr, "Unable to open a replay file\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (fwrite(path->steps, sizeof(int32_t), path->used, path->replay) != (size_t)path->used) {
+                fprintf(stderr, "Unable to write to the replay file\n");
+                exit(EXIT_FAILURE);
+            }
+            path->used = 0;
+        }
+    }
+    path->steps[path->used++] = room;
+    ++path->stepCount;
+}
+
+
+/*
+Outputs the name of every room on the path: the steps spilled to the replay
+file, read back a chunk at a time, then the ones still in the buffer.
+*/
+void printPath(FILE *stream, struct pathLog *path, struct world *aWorld) {
+    int32_t *chunk;
+    size_t got, i;
+    int j;
+
+    if (path->replay) {
+        chunk = (int32_t *)malloc(PATH_CHUNK * sizeof(int32_t));
+        assert(chunk != 0);
+        fflush(path->replay);
+        rewind(path->replay);
+        while ((got = fread(chunk, sizeof(int32_t), PATH_CHUNK, path->replay)) > 0) {
+            for (i = 0; i < got; ++i) {
+                fprintf(stream, "%s\n", roomName(aWorld, chunk[i]));
+            }
+        }
+        if (ferror(path->replay)) {
+            fprintf(stderr, "Unable to read the replay file\n");
+            exit(EXIT_FAILURE);
+        }
+        free(chunk);
+    }
+    for (j = 0; j < path->used; ++j) {
+        fprintf(stream, "%s\n", roomName(aWorld, path->steps[j]));
+    }
+}
+
+
+/*
+Frees the path buffer and removes the replay file.
+*/
+void destroyPath(struct pathLog *path) {
+    free(path->steps);
+    path->steps = NULL;
+    if (path->replay) {
+        fclose(path->replay);
+        path->replay = NULL;
+    }
+}
+
+
+/*
+Finds a shortest path from the start room to the end room with a breadth
+first search.  previous must hold a room per room of the world; on return it
+links each room reached back to the room it was reached from.
+Returns the number of moves of the shortest path, or -1 if the end room
+cannot be reached.
+*/
+int shortestPath(struct world *aWorld, int *previous) {
+    int *queue = NULL;
+    int head = 0, tail = 0;
+    int room, next, i, moves = -1;
+    uint32_t j;
+
+    queue = (int *)malloc(aWorld->roomCount * sizeof(int));
+    assert(queue != 0);
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        previous[i] = -1;
+    }
+    previous[aWorld->startRoom] = aWorld->startRoom;
+    queue[tail++] = aWorld->startRoom;
+    while (head < tail && previous[aWorld->endRoom] == -1) {
+        room = queue[head++];
+        for (j = aWorld->rows[room]; j < aWorld->rows[room + 1]; ++j) {
+            next = aWorld->edges[j];
+            if (previous[next] == -1) {
+                previous[next] = room;
+                queue[tail++] = next;
+            }
+        }
+    }
+    if (previous[aWorld->endRoom] != -1) {
+        moves = 0;
+        for (room = aWorld->endRoom; room != aWorld->startRoom; room = previous[room]) {
+            ++moves;
+        }
+    }
+    free(queue);
+    return moves;
+}
+
+
+/*
+Outputs the shortest path of a map on one line: the number of moves, then
+the rooms moved to in order.  A map that cannot be loaded gets an error line
+instead.
+Returns the number of moves, -1 if the map cannot be solved, or -2 if it
+cannot be loaded.
+*/
+int solveMap(char *directoryName) {
+    struct world aWorld;
+    int *previous = NULL;
+    int *path = NULL;
+    int moves, room, i;
+    double started = startTimer();
+
+    if (loadWorld(directoryName, &aWorld) == 0) {
+        printf("%s: UNABLE TO LOAD THE MAP\n", directoryName);
+        return -2;
+    }
+    /* the search reads every room, so they are all checked first */
+    if (checkRooms(&aWorld) == 0) {
+        fprintf(stderr, "Map in %s is damaged\n", directoryName);
+        printf("%s: UNABLE TO LOAD THE MAP\n", directoryName);
+        destroyWorld(&aWorld);
+        return -2;
+    }
+    stopTimer(&gameMetrics.loadSeconds, started);
+    setMapMetrics(&aWorld);
+    previous = (int *)malloc(aWorld.roomCount * sizeof(int));
+    assert(previous != 0);
+    moves = shortestPath(&aWorld, previous);
+    if (moves == -1) {
+        printf("%s: NO PATH FROM %s TO %s\n", directoryName,
+               roomName(&aWorld, aWorld.startRoom), roomName(&aWorld, aWorld.endRoom));
+    } else {
+        /* the links run from the end room back to the start room */
+        path = (int *)malloc((moves + 1) * sizeof(int));
+        assert(path != 0);
+        i = moves;
+        for (room = aWorld.endRoom; room != aWorld.startRoom; room = previous[room]) {
+            path[--i] = room;
+        }
+        printf("%s: %d STEPS:", directoryName, moves);
+        for (i = 0; i < moves; ++i) {
+            printf(" %s%s", roomName(&aWorld, path[i]), (i < moves - 1) ? "," : "\n");
+        }
+        free(path);
+    }
+    free(previous);
+    destroyWorld(&aWorld);
+    return moves;
+}
+
+
+/*
+Solves a map and adds its shortest path to the tally.
+*/
+void tallyMap(struct solveTally *tally, char *directoryName) {
+    int moves = solveMap(directoryName);
+
+    if (moves == -2) {
+        ++tally->damaged;
+        return;
+    }
+    if (moves == -1) {
+        ++tally->unsolvable;
+        return;
+    }
+    ++tally->solved;
+    tally->totalMoves += moves;
+    if (tally->shortest == -1 || moves < tally->shortest) {
+        tally->shortest = moves;
+    }
+    if (moves > tally->longest) {
+        tally->longest = moves;
+    }
+}
+
+
+/*
+Solves every map named on the command line, without playing.  A name holding
+"lindorg.rooms." is a map directory; any other directory is searched for the
+maps in it.  With no names the newest map is solved.  A map or directory
+that cannot be read is reported and the rest are still solved.  A summary
+line follows the maps.
+Returns 1 if every map can be solved, otherwise returns 0.
+*/
+int solveMaps(int nameCount, char *names[]) {
+    struct solveTally tally = { 0, 0, 0, -1, -1, 0 };
+    struct dirent **entries = NULL;
+    char mapName[STR];
+    char *newest = NULL;
+    int entryCount, i, j;
+    double started;
+
+    if (nameCount == 0) {
+        started = startTimer();
+        newest = openDirectory();
+        stopTimer(&gameMetrics.openSeconds, started);
+        if (!newest) {
+            fprintf(stderr, "Unable to find a lindorg.rooms directory\n");
+            exit(EXIT_FAILURE);
+        }
+        tallyMap(&tally, newest);
+        free(newest);
+    }
+    for (i = 0; i < nameCount; ++i) {
+        if (strstr(names[i], "lindorg.rooms.") != NULL) {
+            tallyMap(&tally, names[i]);
+            continue;
+        }
+        entryCount = scandir(names[i], &entries, NULL, alphasort);
+        if (entryCount == -1) {
+            printf("%s: UNABLE TO OPEN THE DIRECTORY\n", names[i]);
+            ++tally.damaged;
+            continue;
+        }
+        for (j = 0; j < entryCount; ++j) {
+            /* the latest link would solve its map twice */
+            if (strstr(entries[j]->d_name, "lindorg.rooms.") != NULL
+                && strcmp(entries[j]->d_name, LATEST_LINK) != 0) {
+                if (snprintf(mapName, STR, "%s/%s", names[i], entries[j]->d_name) >= STR) {
+                    printf("%s/%s: MAP NAME IS TOO LONG\n", names[i], entries[j]->d_name);
+                    ++tally.damaged;
+                } else {
+                    tallyMap(&tally, mapName);
+                }
+            }
+            free(entries[j]);
+        }
+        free(entries);
+    }
+    printf("SOLVED %d MAPS, %d UNSOLVABLE", tally.solved, tally.unsolvable);
+    if (tally.damaged > 0) {
+        printf(", %d UNREADABLE", tally.damaged);
+    }
+    if (tally.solved > 0) {
+        printf(", SHORTEST PATHS %d TO %d STEPS, %.2f ON AVERAGE", tally.shortest, tally.longest,
+               (double)tally.totalMoves / tally.solved);
+    }
+    printf("\n");
+    return tally.unsolvable == 0 && tally.damaged == 0;
+}
+
+
+/*
+Outputs how the player's path compares with a shortest one, or that the map
+has no path to the end room, so there is nothing to compare with.
+*/
+void scoreGame(FILE *stream, struct world *aWorld, long stepCount) {
+    int *previous = NULL;
+    int moves;
+
+    previous = (int *)malloc(aWorld->roomCount * sizeof(int));
+    assert(previous != 0);
+    moves = shortestPath(aWorld, previous);
+    free(previous);
+    if (moves < 0) {
+        fprintf(stream, "THIS MAP HAS NO PATH TO THE END ROOM, SO IT CANNOT BE SCORED.\n");
+        return;
+    }
+    fprintf(stream, "THE SHORTEST PATH WAS %d STEPS. YOUR SCORE: %ld%%\n", moves,
+           stepCount > 0 ? moves * 100L / stepCount : 0);
+}
+
+
+/*
+Plays one game on a world, reading the player's commands from input, and
+ends it with the victory message.  turns counts the commands read.
+Returns 1 if the player found the end room, returns 0 if input ran out first.
+*/
+int playGame(struct world *aWorld, struct settings *options, struct timeService *timeKeeper,
+             FILE *input, long *turns) {
+    struct pathLog victoryPath;
+    int start = -1, end = -1, result = -1;
+    int previousRoom = -1;
+
+    initPath(&victoryPath);
+    countMetric(&gameMetrics.games);
+    /* start and end rooms come from the loader */
+    start = aWorld->startRoom;
+    end = aWorld->endRoom;
+    do {
+    /* prompt user */
+        previousRoom = start;
+        result = prompt(aWorld, start, 1, input, turns, !options->replay);
+        /* when time is called, stay in the same room */
+        if (result == aWorld->roomCount) {
+            do {
+                showTime(stdout, timeKeeper, options->writeTime);
+                result = previousRoom;
+                result = prompt(aWorld, result, 0, input, turns, !options->replay);
+            } while (result == aWorld->roomCount); /* if the user selects "time" repetitively */
+        }
+        if (result == -1) {
+            destroyPath(&victoryPath);
+            return 0;
+        }
+        start = result;
+        if (result != previousRoom) {
+            recordStep(&victoryPath, result);
+        }
+    } while (start != end);
+    countMetric(&gameMetrics.wins);
+    showVictory(stdout, aWorld, options, &victoryPath);
+    destroyPath(&victoryPath);
+    return 1;
+}
+
+
+/*
+Outputs the victory message: the steps taken, the path and, with -o, the
+score.
+*/
+void showVictory(FILE *stream, struct world *aWorld, struct settings *options, struct pathLog *path) {
+    fprintf(stream, "YOU HAVE FOUND THE END ROOM. CONGRATULATIONS!\n");
+    fprintf(stream, "YOU TOOK %ld STEPS. YOUR PATH TO VICTORY WAS: \n", path->stepCount);
+    printPath(stream, path, aWorld);
+    if (options->score) {
+        scoreGame(stream, aWorld, path->stepCount);
+    }
+}
+
+
+/*
+Replays command scripts, one game per script ("-" is standard input), on
+the same world.  Output is collected in one large buffer, or discarded with
+-q, and the number of turns per second goes to standard error.
+Returns 1 if every script finds the end room, otherwise returns 0.
+*/
+int replayScripts(struct world *aWorld, struct settings *options, struct timeService *timeKeeper,
+                  int scriptCount, char *scripts[]) {
+    static char outputBuffer[REPLAY_BUFFER];
+    char *standardInput[] = { "-" };
+    FILE *input;
+    long turns = 0;
+    int finished = 0, i;
+    double started, elapsed;
+
+    if (scriptCount == 0) {
+        scriptCount = 1;
+        scripts = standardInput;
+    }
+    if (options->quiet && !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Unable to discard the output\n");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, outputBuffer, _IOFBF, REPLAY_BUFFER);
+    started = readClock();
+    for (i = 0; i < scriptCount; ++i) {
+        input = strcmp(scripts[i], "-") == 0 ? stdin : fopen(scripts[i], "r");
+        if (!input) {
+            fprintf(stderr, "Unable to open the script %s\n", scripts[i]);
+            exit(EXIT_FAILURE);
+        }
+        finished += playGame(aWorld, options, timeKeeper, input, &turns);
+        if (input != stdin) {
+            fclose(input);
+        }
+    }
+    fflush(stdout);
+    elapsed = readClock() - started;
+    fprintf(stderr, "REPLAYED %d SCRIPTS (%d FOUND THE END ROOM), %ld TURNS IN %.3fs: %.0f TURNS PER SECOND\n",
+            scriptCount, finished, turns, elapsed, elapsed > 0 ? turns / elapsed : 0.0);
+    return finished == scriptCount;
+}
+
+
+/*
+Returns the time of a monotonic clock in seconds.
+*/
+double readClock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+Starts keeping metrics for export to a file.  SIGUSR1 is blocked here, in
+the main thread, so every thread started later blocks it too and only the
+metrics thread, waiting for it, takes the signal.
+*/
+void startMetrics(char *path) {
+    sigset_t signals;
+    int resultCode;
+
+    gameMetrics.path = path;
+    gameMetrics.stop = 0;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    resultCode = pthread_create(&gameMetrics.thread, NULL, runMetrics, NULL);
+    assert(0 == resultCode);
+}
+
+
+/*
+Has the metrics thread write the metrics one last time, and waits for it.
+Does nothing if no metrics are kept.
+*/
+void stopMetrics(void) {
+    int resultCode;
+
+    if (!gameMetrics.path) {
+        return;
+    }
+    __atomic_store_n(&gameMetrics.stop, 1, __ATOMIC_RELEASE);
+    pthread_kill(gameMetrics.thread, SIGUSR1);
+    resultCode = pthread_join(gameMetrics.thread, NULL);
+    assert(0 == resultCode);
+}
+
+
+/*
+Thread body of the metrics: writes the metrics file each time SIGUSR1
+arrives, until stopMetrics asks for the last one.
+*/
+void *runMetrics(void *argument) {
+    sigset_t signals;
+    int signalNumber;
+
+    (void)argument;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    do {
+        sigwait(&signals, &signalNumber);
+        writeMetrics();
+    } while (!__atomic_load_n(&gameMetrics.stop, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+
+/*
+Returns the start of a timed section, or 0 if no metrics are kept, which
+spares the clock reads.
+*/
+double startTimer(void) {
+    return gameMetrics.path ? readClock() : 0.0;
+}
+
+
+/*
+Adds the time since started to a latency histogram.
+Returns the time it stopped at, to start the next section without another
+clock read, or 0 if no metrics are kept.
+*/
+double stopTimer(struct histogram *latency, double started) {
+    double now, seconds;
+    int i = 0;
+
+    if (!gameMetrics.path) {
+        return 0.0;
+    }
+    now = readClock();
+    seconds = now - started;
+    while (i < LATENCY_BUCKETS - 1 && seconds > latencyBounds[i]) {
+        ++i;
+    }
+    __atomic_add_fetch(&latency->counts[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->sumNanos, (unsigned long long)(seconds * 1e9), __ATOMIC_RELAXED);
+    return now;
+}
+
+
+/*
+Adds one to a counter of the metrics.
+*/
+void countMetric(unsigned long *counter) {
+    if (gameMetrics.path) {
+        __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+Records the size of a loaded map in the metrics.
+*/
+void setMapMetrics(struct world *aWorld) {
+    __atomic_store_n(&gameMetrics.rooms, aWorld->roomCount, __ATOMIC_RELAXED);
+    __atomic_store_n(&gameMetrics.edges, aWorld->rows[aWorld->roomCount], __ATOMIC_RELAXED);
+    __atomic_store_n(&gameMetrics.mapBytes, aWorld->imageSize, __ATOMIC_RELAXED);
+}
+
+
+/*
+Writes the metrics in the Prometheus text format to a temporary file, then
+renames it over the metrics file.
+*/
+void writeMetrics(void) {
+    char fileName[STR];
+    FILE *stream;
+
+    if (snprintf(fileName, STR, "%s.tmp", gameMetrics.path) >= STR) {
+        fprintf(stderr, "Metrics file name %s is too long\n", gameMetrics.path);
+        return;
+    }
+    stream = fopen(fileName, "w");
+    if (!stream) {
+        fprintf(stderr, "Unable to write the metrics to %s\n", fileName);
+        return;
+    }
+    writeHistogram(stream, "lindorg_adventure_open_directory_seconds",
+                   "Time to find the newest map directory.", &gameMetrics.openSeconds);
+    writeHistogram(stream, "lindorg_adventure_load_seconds",
+                   "Time to load a map, or attach to its shared segment.", &gameMetrics.loadSeconds);
+    writeHistogram(stream, "lindorg_adventure_prompt_wait_seconds",
+                   "Time spent waiting for the player's next line.", &gameMetrics.waitSeconds);
+    writeHistogram(stream, "lindorg_adventure_turn_seconds",
+                   "Time to play a line once it is read.", &gameMetrics.turnSeconds);
+    writeHistogram(stream, "lindorg_adventure_lookup_seconds",
+                   "Time to look a room up and check it is a connection.", &gameMetrics.lookupSeconds);
+    writeHistogram(stream, "lindorg_adventure_time_request_seconds",
+                   "Time to answer a time command.", &gameMetrics.timeSeconds);
+    writeCounter(stream, "lindorg_adventure_turns_total", "counter", "Lines played.",
+                 __atomic_load_n(&gameMetrics.turns, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_invalid_inputs_total", "counter",
+                 "Lines naming no connected room.",
+                 __atomic_load_n(&gameMetrics.invalidInputs, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_time_requests_total", "counter", "Time commands.",
+                 __atomic_load_n(&gameMetrics.timeRequests, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_games_total", "counter", "Games started on the terminal or by replay.",
+                 __atomic_load_n(&gameMetrics.games, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_wins_total", "counter", "Games that found the end room.",
+                 __atomic_load_n(&gameMetrics.wins, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_sessions_total", "counter", "Sessions accepted by the server.",
+                 __atomic_load_n(&gameMetrics.sessions, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_reloads_total", "counter", "New maps swapped into the server.",
+                 __atomic_load_n(&gameMetrics.reloads, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_reload_failures_total", "counter",
+                 "New maps that could not be loaded, the server kept its map.",
+                 __atomic_load_n(&gameMetrics.reloadFailures, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_map_rooms", "gauge", "Rooms of the map loaded last.",
+                 __atomic_load_n(&gameMetrics.rooms, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_map_edges", "gauge", "Connections of the map loaded last.",
+                 __atomic_load_n(&gameMetrics.edges, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_adventure_map_bytes", "gauge", "Size of the map image loaded last.",
+                 __atomic_load_n(&gameMetrics.mapBytes, __ATOMIC_RELAXED));
+    if (fclose(stream) != 0 || rename(fileName, gameMetrics.path) == -1) {
+        fprintf(stderr, "Unable to write the metrics to %s\n", gameMetrics.path);
+        unlink(fileName);
+    }
+}
+
+
+/*
+Writes one counter or gauge with its help and type lines.
+*/
+void writeCounter(FILE *stream, char *name, char *type, char *help, unsigned long value) {
+    fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+
+/*
+Writes one latency histogram: its cumulative buckets, sum and count.
+*/
+void writeHistogram(FILE *stream, char *name, char *help, struct histogram *latency) {
+    unsigned long total = 0;
+    int i;
+
+    fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < LATENCY_BUCKETS; ++i) {
+        total += __atomic_load_n(&latency->counts[i], __ATOMIC_RELAXED);
+        if (i < LATENCY_BUCKETS - 1) {
+            fprintf(stream, "%s_bucket{le=\"%g\"} %lu\n", name, latencyBounds[i], total);
+        } else {
+            fprintf(stream, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+        }
+    }
+    fprintf(stream, "%s_sum %.9f\n%s_count %lu\n", name,
+            __atomic_load_n(&latency->sumNanos, __ATOMIC_RELAXED) / 1e9, name, total);
+}
+
+
+/*
+Serves games over a Unix domain socket until SIGINT or SIGTERM.  One thread
+runs a non blocking epoll loop over the listening socket and every session;
+a map is shared by all the sessions playing it and never changes.  A turn's
+output is sent with one writev: what was rendered into one memory stream, the
+room's pre-rendered menu and the prompt.  The server takes aWorld over as
+its first map version; with -u newer maps are swapped in as they appear.
+Returns 1 when the server stops cleanly.
+*/
+int runServer(struct world *aWorld, char *directoryName, struct settings *options,
+              struct timeService *timeKeeper) {
+    struct server aServer;
+    struct epoll_event events[SERVER_EVENTS];
+    struct epoll_event event;
+    struct session *aSession;
+    int listener, count, i;
+
+    aServer.current = makeVersion(aWorld, directoryName, 1);
+    aServer.watchFd = -1;
+    aServer.reloadFd = -1;
+    aServer.loading = 0;
+    aServer.reloadPending = 0;
+    aServer.loaded = NULL;
+    aServer.rejected = NULL;
+    aServer.options = options;
+    aServer.timeKeeper = timeKeeper;
+    aServer.sessions = NULL;
+    aServer.openSessions = 0;
+    aServer.sessionCount = 0;
+    aServer.turns = 0;
+    aServer.text = NULL;
+    aServer.textSize = 0;
+    aServer.out = open_memstream(&aServer.text, &aServer.textSize);
+    assert(aServer.out != 0);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    listener = openListener(options->socketPath);
+    aServer.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (aServer.epollFd == -1) {
+        fprintf(stderr, "Unable to create an epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+    /* the listener is the only event without a session */
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(aServer.epollFd, EPOLL_CTL_ADD, listener, &event) == -1) {
+        fprintf(stderr, "Unable to watch %s\n", options->socketPath);
+        exit(EXIT_FAILURE);
+    }
+    if (options->reload) {
+        watchMaps(&aServer);
+    }
+    fprintf(stderr, "SERVING %d ROOMS ON %s\n", aServer.current->aWorld.roomCount, options->socketPath);
+    while (!serverStopping) {
+        count = epoll_wait(aServer.epollFd, events, SERVER_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Unable to wait for sessions\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < count; ++i) {
+            /* the map watch and the loader are told apart by their descriptors' addresses */
+            if (events[i].data.ptr == &aServer.watchFd) {
+                readMapEvents(&aServer);
+                continue;
+            }
+            if (events[i].data.ptr == &aServer.reloadFd) {
+                swapMap(&aServer);
+                continue;
+            }
+            aSession = (struct session *)events[i].data.ptr;
+            if (!aSession) {
+                acceptSessions(&aServer, listener);
+            } else if (events[i].events & EPOLLOUT) {
+                flushSession(&aServer, aSession);
+            } else {
+                readSession(&aServer, aSession);
+            }
+        }
+    }
+    while (aServer.sessions) {
+        endSession(&aServer, aServer.sessions);
+    }
+    if (aServer.loading) {
+        pthread_join(aServer.loader, NULL);
+        if (aServer.loaded) {
+            aServer.loaded->retired = 1;
+            releaseVersion(aServer.loaded);
+        }
+    }
+    aServer.current->retired = 1;
+    releaseVersion(aServer.current);
+    free(aServer.rejected);
+    fprintf(stderr, "SERVED %ld SESSIONS, %ld TURNS\n", aServer.sessionCount, aServer.turns);
+    if (options->reload) {
+        close(aServer.watchFd);
+        close(aServer.reloadFd);
+    }
+    close(aServer.epollFd);
+    close(listener);
+    unlink(options->socketPath);
+    fclose(aServer.out);
+    free(aServer.text);
+    return 1;
+}
+
+
+/*
+Signal handler of the server: the epoll loop stops at its next wake up.
+*/
+void stopServer(int signalNumber) {
+    (void)signalNumber;
+    serverStopping = 1;
+}
+
+
+/*
+Creates the non blocking listening socket of the server.  A socket left at
+the path by an earlier server is replaced; any other file is not.
+Returns the listening socket.
+*/
+int openListener(char *socketPath) {
+    struct sockaddr_un address;
+    struct stat attributes;
+    int listener;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socketPath);
+    if (lstat(socketPath, &attributes) == 0 && S_ISSOCK(attributes.st_mode)) {
+        unlink(socketPath);
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1
+        || listen(listener, SOMAXCONN) == -1) {
+        fprintf(stderr, "Unable to listen on %s\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    return listener;
+}
+
+
+/*
+Makes a map version of a loaded world.  The version takes the world over:
+what was passed in is left empty, so destroying it frees nothing.
+Returns the version, without readers.
+*/
+struct mapVersion *makeVersion(struct world *aWorld, char *directoryName, long epoch) {
+    struct mapVersion *version = (struct mapVersion *)malloc(sizeof(struct mapVersion));
+    assert(version != 0);
+
+    version->aWorld = *aWorld;
+    aWorld->image = NULL;
+    aWorld->mapped = 0;
+    aWorld->ownTables = 0;
+    aWorld->index.slots = NULL;
+    aWorld->menuRows = NULL;
+    aWorld->menuText = NULL;
+    version->directoryName = (char *)malloc((strlen(directoryName) + 1) * sizeof(char));
+    assert(version->directoryName != 0);
+    strcpy(version->directoryName, directoryName);
+    version->epoch = epoch;
+    version->readers = 0;
+    version->retired = 0;
+    return version;
+}
+
+
+/*
+Frees a map version once it is retired and its last reader has left;
+otherwise does nothing.
+*/
+void releaseVersion(struct mapVersion *version) {
+    if (!version->retired || version->readers > 0) {
+        return;
+    }
+    destroyWorld(&version->aWorld);
+    free(version->directoryName);
+    free(version);
+}
+
+
+/*
+Starts watching the working directory for new maps (-u): an inotify instance
+reports entries created in or renamed into it, and the loader thread signals
+an eventfd when it is done.  Both are added to the epoll loop.
+*/
+void watchMaps(struct server *aServer) {
+    struct epoll_event event;
+
+    aServer->watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    aServer->reloadFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aServer->watchFd == -1 || aServer->reloadFd == -1
+        || inotify_add_watch(aServer->watchFd, ".", IN_CREATE | IN_MOVED_TO) == -1) {
+        fprintf(stderr, "Unable to watch the working directory for new maps\n");
+        exit(EXIT_FAILURE);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &aServer->watchFd;
+    if (epoll_ctl(aServer->epollFd, EPOLL_CTL_ADD, aServer->watchFd, &event) == -1) {
+        fprintf(stderr, "Unable to watch the working directory for new maps\n");
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &aServer->reloadFd;
+    if (epoll_ctl(aServer->epollFd, EPOLL_CTL_ADD, aServer->reloadFd, &event) == -1) {
+        fprintf(stderr, "Unable to watch the working directory for new maps\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+Reads what inotify saw in the working directory.  A map directory renamed
+into place or a new lindorg.rooms.latest link starts a reload; staging
+directories and other files are ignored.
+*/
+void readMapEvents(struct server *aServer) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t got;
+    char *next;
+    int changed = 0;
+
+    while ((got = read(aServer->watchFd, buffer, sizeof(buffer))) > 0) {
+        for (next = buffer; next < buffer + got; next += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)next;
+            if (event->len > 0 && strncmp(event->name, "lindorg.rooms.", 14) == 0) {
+                changed = 1;
+            }
+        }
+    }
+    if (changed) {
+        startReload(aServer);
+    }
+}
+
+
+/*
+Starts the loader thread on the newest map.  While one runs, a new request
+only marks another load for when it is done, so a burst of events costs one
+or two loads.  SIGINT and SIGTERM are blocked in the thread, so they still
+wake the epoll loop.
+*/
+void startReload(struct server *aServer) {
+    sigset_t blocked, previous;
+    int resultCode;
+
+    if (aServer->loading) {
+        aServer->reloadPending = 1;
+        return;
+    }
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    aServer->loaded = NULL;
+    resultCode = pthread_create(&aServer->loader, NULL, loadNewMap, aServer);
+    assert(0 == resultCode);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    aServer->loading = 1;
+}
+
+
+/*
+Thread body of the map loader: finds the newest map and, unless it is the one
+being served, loads it (and renders its menus) into a new version left in
+loaded.  A map that cannot be loaded is reported and counted, and the server
+keeps the version it has.  The epoll loop does not swap versions while the
+loader runs, so the current version can be read here.  reloadFd is signalled
+either way.
+*/
+void *loadNewMap(void *argument) {
+    struct server *aServer = (struct server *)argument;
+    struct world aWorld;
+    char *directoryName;
+    uint64_t one = 1;
+    double started;
+    int loaded;
+
+    started = startTimer();
+    directoryName = openDirectory();
+    stopTimer(&gameMetrics.openSeconds, started);
+    if (directoryName && strcmp(directoryName, aServer->current->directoryName) != 0
+        && (!aServer->rejected || strcmp(directoryName, aServer->rejected) != 0)) {
+        started = startTimer();
+        if (aServer->options->shared) {
+            loaded = loadSharedWorld(directoryName, &aWorld);
+        } else {
+            loaded = loadWorld(directoryName, &aWorld);
+            if (loaded && makeMenus(&aWorld) == 0) {
+                fprintf(stderr, "Map in %s is damaged\n", directoryName);
+                destroyWorld(&aWorld);
+                loaded = 0;
+            }
+        }
+        stopTimer(&gameMetrics.loadSeconds, started);
+        if (loaded) {
+            aServer->loaded = makeVersion(&aWorld, directoryName, aServer->current->epoch + 1);
+        } else {
+            countMetric(&gameMetrics.reloadFailures);
+            fprintf(stderr, "Unable to load the map in %s, still serving %s\n", directoryName,
+                    aServer->current->directoryName);
+            free(aServer->rejected);
+            aServer->rejected = directoryName;
+            directoryName = NULL;
+        }
+    }
+    free(directoryName);
+    if (write(aServer->reloadFd, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Unable to signal a loaded map\n");
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+
+/*
+Takes the result of the loader thread once it has signalled.  A newly loaded
+version becomes current, so the next session starts on it, and the old one is
+retired: it is freed now if no session plays it, otherwise by the last of
+them.  A reload asked for meanwhile starts now.
+*/
+void swapMap(struct server *aServer) {
+    struct mapVersion *old;
+    uint64_t signalled;
+
+    if (read(aServer->reloadFd, &signalled, sizeof(signalled)) == -1) {
+        return;
+    }
+    pthread_join(aServer->loader, NULL);
+    aServer->loading = 0;
+    if (aServer->loaded) {
+        old = aServer->current;
+        aServer->current = aServer->loaded;
+        aServer->loaded = NULL;
+        setMapMetrics(&aServer->current->aWorld);
+        countMetric(&gameMetrics.reloads);
+        fprintf(stderr, "SERVING %d ROOMS OF %s (EPOCH %ld)\n", aServer->current->aWorld.roomCount,
+                aServer->current->directoryName, aServer->current->epoch);
+        /* new processes load the new map, so the old one's segment goes */
+        if (old->aWorld.segmentName[0] != '\0') {
+            shm_unlink(old->aWorld.segmentName);
+        }
+        old->retired = 1;
+        releaseVersion(old);
+    }
+    if (aServer->reloadPending) {
+        aServer->reloadPending = 0;
+        startReload(aServer);
+    }
+}
+
+
+/*
+Accepts every pending connection and starts a session for each: it reads
+the current map version, is placed in its start room and is sent its first
+menu.
+*/
+void acceptSessions(struct server *aServer, int listener) {
+    struct session *aSession;
+    struct epoll_event event;
+    int fd;
+
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        aSession = (struct session *)malloc(sizeof(struct session));
+        assert(aSession != 0);
+        aSession->fd = fd;
+        aSession->map = aServer->current;
+        ++aSession->map->readers;
+        aSession->room = aSession->map->aWorld.startRoom;
+        initPath(&aSession->path);
+        aSession->inputUsed = 0;
+        aSession->pending = NULL;
+        aSession->pendingSize = 0;
+        aSession->pendingSent = 0;
+        aSession->finished = 0;
+        aSession->hungUp = 0;
+        aSession->previous = NULL;
+        aSession->next = aServer->sessions;
+        if (aServer->sessions) {
+            aServer->sessions->previous = aSession;
+        }
+        aServer->sessions = aSession;
+        ++aServer->openSessions;
+        ++aServer->sessionCount;
+        countMetric(&gameMetrics.sessions);
+        event.events = EPOLLIN;
+        event.data.ptr = aSession;
+        if (epoll_ctl(aServer->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            fprintf(stderr, "Unable to watch a session\n");
+            exit(EXIT_FAILURE);
+        }
+        sendOutput(aServer, aSession, aSession->room);
+    }
+    /* out of descriptors only delays the connection until one is closed */
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EMFILE && errno != ENFILE
+        && errno != ECONNABORTED && errno != EINTR) {
+        fprintf(stderr, "Unable to accept a session\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+Reads what a session has sent and plays its complete lines.  When the client
+hangs up, the lines it sent are still played and answered before the session
+ends.
+*/
+void readSession(struct server *aServer, struct session *aSession) {
+    ssize_t got;
+
+    while (aSession->inputUsed < STR - 1) {
+        got = read(aSession->fd, aSession->input + aSession->inputUsed, STR - 1 - aSession->inputUsed);
+        if (got > 0) {
+            aSession->inputUsed += got;
+            continue;
+        }
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            endSession(aServer, aSession);
+            return;
+        }
+        aSession->hungUp = 1;
+        break;
+    }
+    playLines(aServer, aSession);
+}
+
+
+/*
+Plays the complete lines of a session's input, one turn each, until its
+output backs up or its game ends.  A full buffer without a newline is a line
+of its own, as fgets would have read it, and so is what is left when the
+client has hung up.  A hung up session ends once it has nothing left to play
+or send.
+Returns 0 if the session ended, otherwise returns 1.
+*/
+int playLines(struct server *aServer, struct session *aSession) {
+    char *newline;
+    int length, menuRoom;
+
+    while (!aSession->pending && !aSession->finished) {
+        newline = (char *)memchr(aSession->input, '\n', aSession->inputUsed);
+        if (newline) {
+            length = newline - aSession->input;
+            *newline = '\0';
+        } else if (aSession->inputUsed == STR - 1 || (aSession->hungUp && aSession->inputUsed > 0)) {
+            length = aSession->inputUsed;
+            aSession->input[length] = '\0';
+        } else {
+            break;
+        }
+        /* clients on a terminal may end lines with \r\n */
+        if (length > 0 && aSession->input[length - 1] == '\r') {
+            aSession->input[length - 1] = '\0';
+        }
+        menuRoom = playTurn(aServer, aSession, aSession->input);
+        if (newline) {
+            ++length;
+        }
+        aSession->inputUsed -= length;
+        memmove(aSession->input, aSession->input + length, aSession->inputUsed);
+        if (sendOutput(aServer, aSession, menuRoom) == 0) {
+            return 0;
+        }
+    }
+    if (aSession->hungUp && !aSession->pending) {
+        endSession(aServer, aSession);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+Plays one command of a session, as prompt and the game loop do for the
+terminal, and renders the answer into the server's output stream: the time,
+a complaint or the victory message.
+Returns the room whose menu follows the answer, or -1 if none does.
+*/
+int playTurn(struct server *aServer, struct session *aSession, char *command) {
+    struct world *aWorld = &aSession->map->aWorld;
+    double started = startTimer();
+    int result;
+
+    ++aServer->turns;
+    countMetric(&gameMetrics.turns);
+    result = checkInput(aWorld, aSession->room, command);
+    if (result == aWorld->roomCount) {
+        showTime(aServer->out, aServer->timeKeeper, aServer->options->writeTime);
+        stopTimer(&gameMetrics.turnSeconds, started);
+        return -1;
+    }
+    if (result == -1) {
+        countMetric(&gameMetrics.invalidInputs);
+        fputs(HUH_TEXT, aServer->out);
+    } else {
+        aSession->room = result;
+        recordStep(&aSession->path, result);
+        if (result == aWorld->endRoom) {
+            countMetric(&gameMetrics.wins);
+            showVictory(aServer->out, aWorld, aServer->options, &aSession->path);
+            aSession->finished = 1;
+            stopTimer(&gameMetrics.turnSeconds, started);
+            return -1;
+        }
+    }
+    stopTimer(&gameMetrics.turnSeconds, started);
+    return aSession->room;
+}
+
+
+/*
+Sends a turn's output to a session with one writev: what was rendered into
+the server's output stream, the menu of menuRoom (none if it is -1) straight
+from the pre-rendered menus, and the prompt unless the game is over.  What
+the socket does not take is gathered into the session's pending output, and
+the session waits for the socket instead of reading until it is sent.  A
+finished session ends once all its output is sent.
+Returns 0 if the session ended, otherwise returns 1.
+*/
+int sendOutput(struct server *aServer, struct session *aSession, int menuRoom) {
+    struct world *aWorld = &aSession->map->aWorld;
+    struct iovec parts[3];
+    size_t total = 0, skip, used = 0;
+    ssize_t sent;
+    int partCount = 0, i;
+
+    fflush(aServer->out);
+    parts[partCount].iov_base = aServer->text;
+    parts[partCount++].iov_len = aServer->textSize;
+    if (menuRoom != -1) {
+        parts[partCount].iov_base = aWorld->menuText + aWorld->menuRows[menuRoom];
+        parts[partCount++].iov_len = aWorld->menuRows[menuRoom + 1] - aWorld->menuRows[menuRoom];
+    }
+    if (!aSession->finished) {
+        parts[partCount].iov_base = PROMPT_TEXT;
+        parts[partCount++].iov_len = sizeof(PROMPT_TEXT) - 1;
+    }
+    for (i = 0; i < partCount; ++i) {
+        total += parts[i].iov_len;
+    }
+    sent = writev(aSession->fd, parts, partCount);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            rewind(aServer->out);
+            endSession(aServer, aSession);
+            return 0;
+        }
+        sent = 0;
+    }
+    if ((size_t)sent < total) {
+        aSession->pendingSize = total - sent;
+        aSession->pendingSent = 0;
+        aSession->pending = (char *)malloc(aSession->pendingSize);
+        assert(aSession->pending != 0);
+        skip = sent;
+        for (i = 0; i < partCount; ++i) {
+            if (skip >= parts[i].iov_len) {
+                skip -= parts[i].iov_len;
+                continue;
+            }
+            memcpy(aSession->pending + used, (char *)parts[i].iov_base + skip, parts[i].iov_len - skip);
+            used += parts[i].iov_len - skip;
+            skip = 0;
+        }
+        watchSession(aServer, aSession, EPOLLOUT);
+    }
+    rewind(aServer->out);
+    if (aSession->finished && !aSession->pending) {
+        endSession(aServer, aSession);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+Sends what a session's socket can take of its pending output.  Once all of
+it is sent the session reads again and plays the lines it already has.
+*/
+void flushSession(struct server *aServer, struct session *aSession) {
+    ssize_t sent;
+
+    sent = write(aSession->fd, aSession->pending + aSession->pendingSent,
+                 aSession->pendingSize - aSession->pendingSent);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            endSession(aServer, aSession);
+        }
+        return;
+    }
+    aSession->pendingSent += sent;
+    if (aSession->pendingSent < aSession->pendingSize) {
+        return;
+    }
+    free(aSession->pending);
+    aSession->pending = NULL;
+    if (aSession->finished) {
+        endSession(aServer, aSession);
+        return;
+    }
+    if (!aSession->hungUp) {
+        watchSession(aServer, aSession, EPOLLIN);
+    }
+    playLines(aServer, aSession);
+}
+
+
+/*
+Sets the events the epoll loop waits for on a session.
+*/
+void watchSession(struct server *aServer, struct session *aSession, uint32_t events) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = aSession;
+    if (epoll_ctl(aServer->epollFd, EPOLL_CTL_MOD, aSession->fd, &event) == -1) {
+        fprintf(stderr, "Unable to watch a session\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+Closes a session and frees everything it holds.  Its map version loses a
+reader, and is freed if it was retired and this was its last.
+*/
+void endSession(struct server *aServer, struct session *aSession) {
+    epoll_ctl(aServer->epollFd, EPOLL_CTL_DEL, aSession->fd, NULL);
+    close(aSession->fd);
+    destroyPath(&aSession->path);
+    free(aSession->pending);
+    --aSession->map->readers;
+    releaseVersion(aSession->map);
+    if (aSession->previous) {
+        aSession->previous->next = aSession->next;
+    } else {
+        aServer->sessions = aSession->next;
+    }
+    if (aSession->next) {
+        aSession->next->previous = aSession->previous;
+    }
+    --aServer->openSessions;
+    free(aSession);
+}
+
+
+/*
+Prompts the user make a selection via a menu selection display, reading the
+answer from input.  Every line read counts as a turn.  With flush the output
+of a turn is written before reading, in one write.
+Returns the index of the selected rooms.
+If the user selects "time", the prompt returns the size of the list.
+Returns -1 when input runs out.
+*/
+int prompt(struct world *aWorld, int index, int showMenu, FILE *input, long *turns, int flush) {
+    char response[STR];
+    int i, strSize, before;
+    double started;
+
+    do {
+        before = index;
+        memset(response, '\0', STR);
+        if (showMenu) {
+            mainMenu(stdout, aWorld, index);
+        }
+        fputs(PROMPT_TEXT, stdout);
+        if (flush) {
+            fflush(stdout);
+        }
+        started = startTimer();
+        if (!fgets(response, STR, input)) {
+            return -1;
+        }
+        started = stopTimer(&gameMetrics.waitSeconds, started);
+        ++*turns;
+        countMetric(&gameMetrics.turns);
+        strSize = strlen(response);
+        /* trim off new line */
+        for (i = strSize; i > 0; --i) {
+            if (response[i] == '\n') {
+                response[i] = '\0';
+                break;
+            }
+        }
+        index = checkInput(aWorld, index, response);
+        if (index == -1) {
+            countMetric(&gameMetrics.invalidInputs);
+            fputs(HUH_TEXT, stdout);
+            index = before;
+        }
+        stopTimer(&gameMetrics.turnSeconds, started);
+    } while (index == -1);
+    return index;
+}
+
+
+/*
+Provides game UI using the values of a selected room: its menu, rendered at
+load time, in one piece.
+*/
+void mainMenu(FILE *stream, struct world *aWorld, int room) {
+    fwrite(aWorld->menuText + aWorld->menuRows[room], 1,
+           aWorld->menuRows[room + 1] - aWorld->menuRows[room], stream);
+}
+
+
+/*
+Renders the menu of every room once, into one block: the menu rows (an
+offset per room and one past the last menu), then the text of the menus.
+Rendering is where a room is first looked up, so each room is checked then.
+Returns 1 if the menus are made, or 0 if a room is damaged (no menus made).
+*/
+int makeMenus(struct world *aWorld) {
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        if (checkRoom(aWorld, i) == 0) {
+            return 0;
+        }
+        size += renderMenu(aWorld, i, NULL);
+    }
+    aWorld->menuRows = (uint64_t *)malloc((aWorld->roomCount + 1) * sizeof(uint64_t) + size);
+    assert(aWorld->menuRows != 0);
+    aWorld->menuText = (char *)(aWorld->menuRows + aWorld->roomCount + 1);
+    size = 0;
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        aWorld->menuRows[i] = size;
+        size += renderMenu(aWorld, i, aWorld->menuText + size);
+    }
+    aWorld->menuRows[aWorld->roomCount] = size;
+    return 1;
+}
+
+
+/*
+Verifies a room: its type, that its connections lie inside the edge section
+(which ends at the last row) and that each leads to a room of the map.
+Returns 1 if the room is valid, otherwise returns 0.
+*/
+int checkRoom(struct world *aWorld, int room) {
+    uint32_t j;
+
+    if (aWorld->types[room] > END_ROOM || aWorld->rows[room] > aWorld->rows[room + 1]
+        || aWorld->rows[room + 1] > aWorld->rows[aWorld->roomCount]) {
+        return 0;
+    }
+    for (j = aWorld->rows[room]; j < aWorld->rows[room + 1]; ++j) {
+        if (aWorld->edges[j] < 0 || aWorld->edges[j] >= aWorld->roomCount) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+Verifies every room of a world.
+Returns 1 if every room is valid, otherwise returns 0.
 */
-int prompt(struct room **list, int index, int showMenu) {
-    char response[STR];
-    int i, strSize, before;
+int checkRooms(struct world *aWorld) {
+    int i;
 
-    do {
-        before = index;
-        memset(response, '\0', STR);
-        if (showMenu) {
-            mainMenu(list[index]);
-        }
-        printf("WHERE TO? >");
-        fgets(response, STR, stdin);
-        strSize = strlen(response);
-        /* trim off new line */
-        for (i = strSize; i > 0; --i) {
-            if (response[i] == '\n') {
-                response[i] = '\0';
-                break;
-            }
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        if (checkRoom(aWorld, i) == 0) {
+            return 0;
         }
-        index = checkInput(list, list[index], response);
-        if (index == -1) {
-            printf("\nHUH? I DON'T UNDERSTAND THAT ROOM. TRY AGAIN.\n\n");
-            index = before;
+    }
+    return 1;
+}
+
+
+/*
+Renders the menu of a room into menu, or only measures it if menu is NULL:
+its name, its connections and its room type.
+Returns the size of the menu.
+*/
+size_t renderMenu(struct world *aWorld, int room, char *menu) {
+    size_t size = 0;
+    uint32_t j;
+
+    size += appendText(menu, size, "CURRENT LOCATIONS: ");
+    size += appendText(menu, size, roomName(aWorld, room));
+    size += appendText(menu, size, "\nPOSSIBLE CONNECTIONS: ");
+    for (j = aWorld->rows[room]; j < aWorld->rows[room + 1]; ++j) {
+        if (j > aWorld->rows[room]) {
+            size += appendText(menu, size, ", ");
         }
-    } while (index == -1);
-    return index;
+        size += appendText(menu, size, roomName(aWorld, aWorld->edges[j]));
+    }
+    size += appendText(menu, size, ".\nROOM TYPE: ");
+    size += appendText(menu, size, roomTypes[aWorld->types[room]]);
+    size += appendText(menu, size, "\n");
+    return size;
 }
 
 
 /*
-Provides game UI using the values of a selected room
+Copies text to buffer at used, unless buffer is NULL.
+Returns the length of text.
 */
-void mainMenu(struct room *aRoom) {
-    int j = 0;
+size_t appendText(char *buffer, size_t used, char *text) {
+    size_t length = strlen(text);
 
-    fprintf(stdout, "CURRENT LOCATIONS: %s\n", aRoom->name);
-    printf("POSSIBLE CONNECTIONS: ");
-    while (aRoom->connections[j] && j < (aRoom->connectCount - 1)) {
-        fprintf(stdout, "%s, ", aRoom->connections[j]);
-        ++j;
+    if (buffer) {
+        memcpy(buffer + used, text, length);
     }
-    fprintf(stdout, "%s.\n", aRoom->connections[j]);
-    fprintf (stdout, "ROOM TYPE: %s\n", aRoom->roomType);
+    return length;
 }
 
 
@@ -240,37 +2169,41 @@ Returns the room index when a room is verified.
 Returns the size of a list, if user inputs "time"
 Otherwise returns -1 for user inputs that cannot be verified.
 */
-int checkInput(struct room **list, struct room *aRoom, char *response) {
+int checkInput(struct world *aWorld, int room, char *response) {
     int roomIndex = -1;
     int size = strlen(response) + 1;
+    double started;
 
-    if (size == 0 || size > 9) {
+    if (size == 0 || size > NAME_SZ) {
         return -1;
     }
     if(strcmp(response, "time") != 0) {
-        roomIndex = searchConnections(aRoom, response);
-        /* search for the room */
-        if (roomIndex != -1) {
-            roomIndex = searchRooms(list, aRoom->connections[roomIndex], 2);
+        /* find the room, then make sure it is a connection */
+        started = startTimer();
+        roomIndex = findRoom(aWorld, response);
+        if (roomIndex != -1 && searchConnections(aWorld, room, roomIndex) == -1) {
+            roomIndex = -1;
         }
+        stopTimer(&gameMetrics.lookupSeconds, started);
      } else { 
-         return SELECTED;
+         return aWorld->roomCount;
      }
      return roomIndex;
 }
 
 
 /*
-Searches the connections of Room.  Each connection holds the name of room
+Searches the connections of Room.  Each connection holds the index of room
 that the user can travel to.
 Returns the index of the connected room otherwise returns -1
 */
-int searchConnections(struct room *aRoom, char *item) {
-    int i, found = -1;
+int searchConnections(struct world *aWorld, int room, int item) {
+    uint32_t j;
+    int found = -1;
 
-    for (i = 0; i < aRoom->connectCount; ++i) {
-        if (!strcmp(aRoom->connections[i], item)) {
-            found = i;
+    for (j = aWorld->rows[room]; j < aWorld->rows[room + 1]; ++j) {
+        if (aWorld->edges[j] == item) {
+            found = j - aWorld->rows[room];
             break;
         }
     }
@@ -279,83 +2212,107 @@ int searchConnections(struct room *aRoom, char *item) {
 
 
 /*
-Searches a room with the option to search by name, the start room, and
-the end room:
-    @section - 0 means search for start room
-               1 means search for end room
-               2 means search a room by search item
-Returns the index of the room that matches the desired search options.
+Displays all the contents of a room
 */
-int searchRooms(struct room **list, char *item, int section) {
-    int startRoom = -1;
-    int endRoom = -1;
-    int foundRoom = -1;
-    int result, i;
-    
-    for (i = 0; i < SELECTED; ++i) {
-        if ((strcmp(list[i]->name, item) == 0) && section == 2) {
-            foundRoom = i;
-            break;
-         }
-        if ((strcmp(list[i]->roomType, "START_ROOM") == 0) && section == 0) {
-            startRoom = i;
+void displayRoom(FILE *stream, struct world *aWorld, int room) {
+    uint32_t j = aWorld->rows[room];
+
+    fprintf(stream, "ROOM NAME: %s\n", roomName(aWorld, room));
+    while (j < aWorld->rows[room + 1]) {
+        fprintf(stream, "CONNECTION %d: %s\n", (int)(j - aWorld->rows[room] + 1),
+                roomName(aWorld, aWorld->edges[j]));
+        ++j;
+    }
+    fprintf (stream, "ROOM TYPE: %s\n", roomTypes[aWorld->types[room]]);
+    printf("\n");
+}
+
+
+/*
+Returns the name of a room, from the string table of the map.
+*/
+char *roomName(struct world *aWorld, int room) {
+    return aWorld->strings + aWorld->names[room];
+}
+
+
+/*
+Builds the name index of a loaded world, with at least twice as many slots
+as rooms.  A repeated name keeps its first room.
+*/
+void makeNameIndex(struct world *aWorld) {
+    unsigned int capacity = indexCapacity(aWorld->roomCount);
+    unsigned int slot;
+    int i;
+
+    aWorld->index.mask = capacity - 1;
+    aWorld->index.slots = (int32_t *)malloc(capacity * sizeof(int32_t));
+    assert(aWorld->index.slots != 0);
+    aWorld->ownTables = 1;
+    memset(aWorld->index.slots, -1, capacity * sizeof(int32_t));
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        slot = hashName(roomName(aWorld, i)) & aWorld->index.mask;
+        while (aWorld->index.slots[slot] != -1
+               && strcmp(roomName(aWorld, aWorld->index.slots[slot]), roomName(aWorld, i))) {
+            slot = (slot + 1) & aWorld->index.mask;
         }
-        if ((strcmp(list[i]->roomType, "END_ROOM") == 0) && section == 1) {
-            endRoom = i;
+        if (aWorld->index.slots[slot] == -1) {
+            aWorld->index.slots[slot] = i;
         }
     }
-    switch(section) {
-        case 0:
-            result = startRoom;
-            break;
-        case 1:
-            result = endRoom;
-            break;
-        case 2:
-            result = foundRoom;
-            break;
-    }
-    return result;
 }
 
 
 /*
-Displays all the contents of a room
+Returns the number of slots of the name index of a world: a power of two, at
+least 16 and at least twice the number of rooms.
 */
-void displayRoom(FILE *stream,struct room *aRoom) {
-    int j = 0;
+unsigned int indexCapacity(int roomCount) {
+    unsigned int capacity = 16;
 
-    fprintf(stream, "ROOM NAME: %s\n", aRoom->name);
-    while (aRoom->connections[j] && j < CONN_SZ) {
-        fprintf(stream, "CONNECTION %d: %s\n", (j + 1), aRoom->connections[j]);
-        ++j;
+    while (capacity < 2u * roomCount) {
+        capacity *= 2;
     }
-    fprintf (stream, "ROOM TYPE: %s\n", aRoom->roomType);
-    printf("\n");
+    return capacity;
 }
 
 
 /*
-Counts all the connections that a room has.
+Looks a room up by name in the name index.
+Returns the index of the room, or -1 if no room has that name.
 */
-void countAllConnections (struct room **list) {
-    int i, j, count;
+int findRoom(struct world *aWorld, char *name) {
+    unsigned int slot = hashName(name) & aWorld->index.mask;
 
-    for (i = 0; i < SELECTED; ++i) {
-        count = 0;
-        j = 0;
-        while (list[i]->connections[j] && j < CONN_SZ) {
-            ++count;
-            ++j;
+    while (aWorld->index.slots[slot] != -1) {
+        if (strcmp(roomName(aWorld, aWorld->index.slots[slot]), name) == 0) {
+            return aWorld->index.slots[slot];
         }
-        list[i]->connectCount = count;
+        slot = (slot + 1) & aWorld->index.mask;
+    }
+    return -1;
+}
+
+
+/*
+Returns the FNV-1a hash of a room name, as lindorg.buildrooms hashes them.
+*/
+unsigned int hashName(char *name) {
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+        ++name;
     }
+    return hash;
 }
 
 
 /*
 Opens current directory and searches for a directory with the
-prefix "lindorg.rooms.".
+prefix "lindorg.rooms.".  The latest link is tried first, the scan is only
+the fallback when there is no link or it points at no directory.
 Returns the full name of that directory
 */
 char *openDirectory() {
@@ -366,13 +2323,17 @@ char *openDirectory() {
     struct dirent *fileInDir;
     struct stat dirAttributes;
 
+    newDirName = readLatestLink();
+    if (newDirName) {
+        return newDirName;
+    }
     /* open current directory */
     dirToCheck = opendir(".");
     if (dirToCheck > 0) { /* check if its open */
         /* search each entry in the directory */
         while ((fileInDir = readdir(dirToCheck)) != NULL) {
-            /* if prefix match entry */
-            if (strstr(fileInDir->d_name, target) != NULL) {
+            /* if prefix match entry, the link itself names no map */
+            if (strstr(fileInDir->d_name, target) != NULL && strcmp(fileInDir->d_name, LATEST_LINK) != 0) {
                 /* get the attributes of the entry */
                 stat(fileInDir->d_name, &dirAttributes);
                 /* get the most recent directory name */
@@ -393,200 +2354,844 @@ char *openDirectory() {
 
 
 /*
-Opens a directory and reads all files in that directory.
+Reads the lindorg.rooms.latest link with one lookup.
+Returns the name of the map directory it points at, or NULL if there is no
+link or its target is not a directory.
+*/
+char *readLatestLink() {
+    char *dirName = NULL;
+    struct stat dirAttributes;
+    ssize_t size;
+
+    dirName = (char *)malloc(STR * sizeof(char));
+    assert(dirName != 0);
+    size = readlink(LATEST_LINK, dirName, STR - 1);
+    if (size > 0) {
+        dirName[size] = '\0';
+        if (stat(dirName, &dirAttributes) == 0 && S_ISDIR(dirAttributes.st_mode)) {
+            return dirName;
+        }
+    }
+    free(dirName);
+    return NULL;
+}
+
+
+/*
+Loads the map stored in a directory: the binary map file if there is one,
+otherwise the room files.  A damaged map is reported on stderr and nothing of
+it is kept.
+Returns 1 if the map is loaded, otherwise returns 0.
+*/
+int loadWorld(char *directoryName, struct world *aWorld) {
+    int flag;
+
+    aWorld->image = NULL;
+    aWorld->imageSize = 0;
+    aWorld->mapped = 0;
+    aWorld->index.slots = NULL;
+    aWorld->menuRows = NULL;
+    aWorld->menuText = NULL;
+    aWorld->ownTables = 0;
+    aWorld->startRoom = -1;
+    aWorld->endRoom = -1;
+    aWorld->segmentName[0] = '\0';
+    flag = loadMapFile(directoryName, aWorld);
+    if (flag == 0) {
+        flag = readDirectory(directoryName, aWorld);
+    }
+    if (flag == 1 && (aWorld->startRoom == -1 || aWorld->endRoom == -1)) {
+        fprintf(stderr, "Map in %s has no start or end room\n", directoryName);
+        flag = -1;
+    }
+    if (flag != 1) {
+        destroyWorld(aWorld);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+Maps the binary map file of a directory into memory as the world's image.
+The world is played in place, so loading costs one open and the page faults
+of the sections that are touched (and the name index).  Only the header and
+the names the index reads are checked here; a room's type and connections
+are checked when it is first looked up (see checkRoom).
+Returns 1 if the map file was loaded, returns 0 if the directory has no map
+file, or -1 if it is damaged (left for destroyWorld to unmap).
+*/
+int loadMapFile(char *directoryName, struct world *aWorld) {
+    char filePath[STR];
+    struct stat attributes;
+    struct mapHeader *header;
+    uint32_t i;
+    int fd;
+
+    snprintf(filePath, STR, "%s/%s", directoryName, MAP_FILENAME);
+    fd = open(filePath, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &attributes) == -1 || (size_t)attributes.st_size < sizeof(struct mapHeader)) {
+        fprintf(stderr, "Map file %s is damaged\n", filePath);
+        close(fd);
+        return -1;
+    }
+    aWorld->imageSize = attributes.st_size;
+    aWorld->image = (char *)mmap(NULL, aWorld->imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (aWorld->image == MAP_FAILED) {
+        aWorld->image = NULL;
+        fprintf(stderr, "Unable to map %s\n", filePath);
+        return -1;
+    }
+    aWorld->mapped = 1;
+    header = (struct mapHeader *)aWorld->image;
+    if (checkMapHeader(header, aWorld->imageSize) == 0) {
+        fprintf(stderr, "Map file %s is damaged\n", filePath);
+        return -1;
+    }
+    pointSections(aWorld);
+    aWorld->startRoom = header->startRoom;
+    aWorld->endRoom = header->endRoom;
+    if (aWorld->rows[header->roomCount] != header->edgeCount
+        || aWorld->types[aWorld->startRoom] != START_ROOM || aWorld->types[aWorld->endRoom] != END_ROOM) {
+        fprintf(stderr, "Map file %s is damaged\n", filePath);
+        return -1;
+    }
+    /* the name index reads every name, so checking them costs no other page */
+    for (i = 0; i < header->roomCount; ++i) {
+        if (aWorld->names[i] >= header->stringSize) {
+            fprintf(stderr, "Map file %s is damaged\n", filePath);
+            return -1;
+        }
+    }
+    makeNameIndex(aWorld);
+    return 1;
+}
+
+
+/*
+Verifies the header of a binary map: magic, version, and that every section
+lies inside the file.  The string table must end with a NUL so every name in
+it is terminated.
+Returns 1 if the header is valid, otherwise returns 0.
+*/
+int checkMapHeader(struct mapHeader *header, size_t mapSize) {
+    uint64_t rooms = header->roomCount;
+
+    if (memcmp(header->magic, MAP_MAGIC, sizeof(header->magic)) != 0
+        || header->version != MAP_VERSION || header->fileSize != mapSize
+        || rooms == 0 || header->stringSize == 0) {
+        return 0;
+    }
+    if (header->typeOffset + rooms > mapSize
+        || header->nameOffset + rooms * sizeof(uint32_t) > mapSize
+        || header->rowOffset + (rooms + 1) * sizeof(uint32_t) > mapSize
+        || header->edgeOffset + (uint64_t)header->edgeCount * sizeof(int32_t) > mapSize
+        || header->stringOffset + header->stringSize > mapSize
+        || (header->nameOffset | header->rowOffset | header->edgeOffset) % 8 != 0) {
+        return 0;
+    }
+    if (header->startRoom < 0 || (uint32_t)header->startRoom >= header->roomCount
+        || header->endRoom < 0 || (uint32_t)header->endRoom >= header->roomCount) {
+        return 0;
+    }
+    return ((char *)header)[header->stringOffset + header->stringSize - 1] == '\0';
+}
+
+
+/*
+Loads a map through a shared memory segment.  The first process to load a
+map publishes it as a segment holding the map image, its name index and its
+menus;
+every later process attaches to the segment instead of loading, in constant
+time and sharing its pages.  A map that cannot be shared is loaded privately.
+Returns 1 if the map is loaded, otherwise returns 0 (see loadWorld).
+*/
+int loadSharedWorld(char *directoryName, struct world *aWorld) {
+    char segmentName[STR];
+
+    if (nameSegment(directoryName, segmentName) == 0) {
+        return 0;
+    }
+    if (attachSegment(segmentName, aWorld)) {
+        return 1;
+    }
+    if (loadWorld(directoryName, aWorld) == 0) {
+        return 0;
+    }
+    if (makeMenus(aWorld) == 0) {
+        fprintf(stderr, "Map in %s is damaged\n", directoryName);
+        destroyWorld(aWorld);
+        return 0;
+    }
+    /* the publisher shares the pages of the segment as well */
+    if (publishSegment(aWorld, segmentName)) {
+        destroyWorld(aWorld);
+        if (attachSegment(segmentName, aWorld) == 0) {
+            if (loadWorld(directoryName, aWorld) == 0) {
+                return 0;
+            }
+            if (makeMenus(aWorld) == 0) {
+                fprintf(stderr, "Map in %s is damaged\n", directoryName);
+                destroyWorld(aWorld);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+Names the shared segment of a map after the identity of its map file, or of
+its directory for room files: device, inode and change time.  A map that is
+rewritten or replaced gets a segment of its own.
+Returns 1 if the segment is named, returns 0 if the map cannot be found.
+*/
+int nameSegment(char *directoryName, char *segmentName) {
+    char filePath[STR];
+    struct stat attributes;
+
+    snprintf(filePath, STR, "%s/%s", directoryName, MAP_FILENAME);
+    if (stat(filePath, &attributes) == -1 && stat(directoryName, &attributes) == -1) {
+        fprintf(stderr, "Unable to open %s\n", directoryName);
+        return 0;
+    }
+    snprintf(segmentName, STR, "/lindorg.map.%lx.%lx.%lx.%lx", (unsigned long)attributes.st_dev,
+             (unsigned long)attributes.st_ino, (unsigned long)attributes.st_ctim.tv_sec,
+             (unsigned long)attributes.st_ctim.tv_nsec);
+    return 1;
+}
+
+
+/*
+Attaches a world to a published segment, read only.  The segment is the map
+image, laid out as a map file, followed by the name index and the menus;
+since they hold offsets and indices only, the world is used in place wherever it is mapped.
+Nothing is parsed or validated room by room, so only segments of the same
+user are trusted.
+Returns 1 if the world is attached, returns 0 if there is no complete
+segment of that name.
+*/
+int attachSegment(char *segmentName, struct world *aWorld) {
+    struct stat attributes;
+    struct mapHeader *header;
+    char *segment;
+    uint64_t menuOffset, textOffset;
+    uint64_t magic;
+    unsigned int capacity;
+    int fd;
+
+    memcpy(&magic, MAP_MAGIC, sizeof(magic));
+    fd = shm_open(segmentName, O_RDONLY, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &attributes) == -1 || attributes.st_uid != geteuid()
+        || (size_t)attributes.st_size < sizeof(struct mapHeader)) {
+        close(fd);
+        return 0;
+    }
+    segment = (char *)mmap(NULL, attributes.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return 0;
+    }
+    header = (struct mapHeader *)segment;
+    /* the magic is stored last (release), so once it is seen the rest is too */
+    if (__atomic_load_n((uint64_t *)header->magic, __ATOMIC_ACQUIRE) != magic) {
+        munmap(segment, attributes.st_size);
+        return 0;
+    }
+    /* the header is checked against the sections it names, so first the size it claims */
+    if (header->fileSize > (uint64_t)attributes.st_size || checkMapHeader(header, header->fileSize) == 0) {
+        munmap(segment, attributes.st_size);
+        return 0;
+    }
+    capacity = indexCapacity(header->roomCount);
+    menuOffset = alignOffset(header->fileSize) + capacity * sizeof(int32_t);
+    textOffset = menuOffset + ((uint64_t)header->roomCount + 1) * sizeof(uint64_t);
+    if ((uint64_t)attributes.st_size < textOffset
+        || ((uint64_t *)(segment + menuOffset))[header->roomCount] != attributes.st_size - textOffset) {
+        munmap(segment, attributes.st_size);
+        return 0;
+    }
+    aWorld->image = segment;
+    aWorld->imageSize = attributes.st_size;
+    aWorld->mapped = 1;
+    pointSections(aWorld);
+    aWorld->startRoom = header->startRoom;
+    aWorld->endRoom = header->endRoom;
+    aWorld->index.mask = capacity - 1;
+    aWorld->index.slots = (int32_t *)(segment + alignOffset(header->fileSize));
+    aWorld->menuRows = (uint64_t *)(segment + menuOffset);
+    aWorld->menuText = segment + textOffset;
+    aWorld->ownTables = 0;
+    strcpy(aWorld->segmentName, segmentName);
+    return 1;
+}
+
+
+/*
+Publishes a loaded world as a shared segment: its image, with the start and
+end rooms the loader found, then its name index and its menus.  The header
+is copied without its magic, which is stored last behind a release, so a
+process attaching meanwhile never sees the magic on an incomplete segment and
+loads the map itself.  The segment stays until it is unlinked (swapMap,
+removeSegments).
+Returns 1 if the segment was published, returns 0 if it exists already or
+cannot be made.
+*/
+int publishSegment(struct world *aWorld, char *segmentName) {
+    struct mapHeader header;
+    uint64_t magic;
+    size_t indexOffset = alignOffset(aWorld->imageSize);
+    size_t menuOffset = indexOffset + (aWorld->index.mask + 1) * sizeof(int32_t);
+    size_t menuSize = (aWorld->roomCount + 1) * sizeof(uint64_t) + aWorld->menuRows[aWorld->roomCount];
+    size_t size = menuOffset + menuSize;
+    char *segment;
+    int fd;
+
+    fd = shm_open(segmentName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return 0;
+    }
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        shm_unlink(segmentName);
+        return 0;
+    }
+    segment = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        shm_unlink(segmentName);
+        return 0;
+    }
+    memcpy(&header, aWorld->image, sizeof(header));
+    memset(header.magic, 0, sizeof(header.magic));
+    header.startRoom = aWorld->startRoom;
+    header.endRoom = aWorld->endRoom;
+    memcpy(segment, &header, sizeof(header));
+    memcpy(segment + sizeof(header), aWorld->image + sizeof(header), aWorld->imageSize - sizeof(header));
+    memcpy(segment + indexOffset, aWorld->index.slots, (aWorld->index.mask + 1) * sizeof(int32_t));
+    /* the menu text follows its rows, as in the world's own block */
+    memcpy(segment + menuOffset, aWorld->menuRows, menuSize);
+    memcpy(&magic, MAP_MAGIC, sizeof(magic));
+    __atomic_store_n((uint64_t *)((struct mapHeader *)segment)->magic, magic, __ATOMIC_RELEASE);
+    munmap(segment, size);
+    return 1;
+}
+
+
+/*
+Unlinks every map segment of the user's from /dev/shm (-c).  Processes
+attached to one keep it until they detach.
+Returns 1 if every segment was unlinked, otherwise returns 0.
+*/
+int removeSegments(void) {
+    char segmentName[STR];
+    DIR *segments;
+    struct dirent *entry;
+    struct stat attributes;
+    int removed = 0, flag = 1;
+
+    segments = opendir("/dev/shm");
+    if (!segments) {
+        fprintf(stderr, "Unable to open /dev/shm\n");
+        return 0;
+    }
+    while ((entry = readdir(segments)) != NULL) {
+        if (strncmp(entry->d_name, "lindorg.map.", 12) != 0
+            || fstatat(dirfd(segments), entry->d_name, &attributes, 0) == -1
+            || attributes.st_uid != geteuid()
+            || snprintf(segmentName, STR, "/%s", entry->d_name) >= STR) {
+            continue;
+        }
+        if (shm_unlink(segmentName) == -1) {
+            fprintf(stderr, "Unable to remove the segment %s\n", segmentName);
+            flag = 0;
+        } else {
+            ++removed;
+        }
+    }
+    closedir(segments);
+    printf("REMOVED %d SEGMENTS\n", removed);
+    return flag;
+}
+
+
+/*
+Deallocates a loaded map, whichever way it was loaded.
+*/
+void destroyWorld(struct world *aWorld) {
+    if (aWorld->ownTables) {
+        free(aWorld->index.slots);
+        free(aWorld->menuRows);
+    }
+    aWorld->index.slots = NULL;
+    aWorld->menuRows = NULL;
+    aWorld->menuText = NULL;
+    if (aWorld->mapped) {
+        munmap(aWorld->image, aWorld->imageSize);
+    } else {
+        free(aWorld->image);
+    }
+    aWorld->image = NULL;
+}
+
+
+/*
+Opens a directory and loads all of its room files into a map image.  The
+listing is split into contiguous slices, one per loader thread.  In the first
+phase each thread reads its files into its own buffer and parses them in
+place.  Once the sizes are known the image is laid out, and the threads copy
+their names, types and rows into it; after the name index is built, the last
+phase resolves each slice's connection names to room indices.
+Returns 1 if every room file is loaded, otherwise returns -1 (what was built
+is left for destroyWorld).
 */
-void readDirectory (char *directoryName, struct room **list) {
+int readDirectory(char *directoryName, struct world *aWorld) {
     DIR *dirToCheck;
     char *target = "_room";
-    int roomIndex = 0;
     struct dirent *fileInDir;
-    char fileName[STR];
+    struct loadSlice *slices = NULL;
+    char *fileNames = NULL;
+    char **roomNames = NULL;
+    unsigned char *roomKinds = NULL;
+    size_t *nameStarts = NULL;
+    size_t used = 0, capacity = 0, nameSize, linkCount = 0, stringSize = 0;
+    int fileCount = 0, fileCapacity = 0;
+    int sliceCount, i, flag = 1;
 
-    memset(fileName, '\0', STR);
     /* open specified directory */
     dirToCheck = opendir(directoryName);
-    if (dirToCheck > 0) { /* check if its open */
-        /* search each entry in the directory */
-        while ((fileInDir = readdir(dirToCheck)) != NULL) {
-            /* if prefix match entry */
-            if (strstr(fileInDir->d_name, target) != NULL) {
-                memset(fileName, '\0', STR);
-                strcpy(fileName, fileInDir->d_name);
-                /* read the file */
-                readFile(directoryName, fileName, list[roomIndex]);
-                ++roomIndex;
-            }
+    if (!dirToCheck) {
+        fprintf(stderr, "Unable to open %s\n", directoryName);
+        return -1;
+    }
+    /* list each room file of the directory */
+    while ((fileInDir = readdir(dirToCheck)) != NULL) {
+        /* if prefix match entry */
+        if (strstr(fileInDir->d_name, target) == NULL) {
+            continue;
+        }
+        nameSize = strlen(fileInDir->d_name) + 1;
+        if (used + nameSize > capacity) {
+            capacity = 2 * (used + nameSize);
+            fileNames = (char *)realloc(fileNames, capacity);
+            assert(fileNames != 0);
+        }
+        if (fileCount == fileCapacity) {
+            fileCapacity = 2 * (fileCount + 1);
+            nameStarts = (size_t *)realloc(nameStarts, fileCapacity * sizeof(size_t));
+            assert(nameStarts != 0);
         }
+        nameStarts[fileCount++] = used;
+        memcpy(fileNames + used, fileInDir->d_name, nameSize);
+        used += nameSize;
     }
+    if (fileCount == 0) {
+        fprintf(stderr, "No room files in %s\n", directoryName);
+        closedir(dirToCheck);
+        free(fileNames);
+        free(nameStarts);
+        return -1;
+    }
+    roomNames = (char **)malloc(fileCount * sizeof(char *));
+    assert(roomNames != 0);
+    roomKinds = (unsigned char *)malloc(fileCount);
+    assert(roomKinds != 0);
+    sliceCount = countLoadThreads(fileCount);
+    slices = (struct loadSlice *)malloc(sliceCount * sizeof(struct loadSlice));
+    assert(slices != 0);
+    for (i = 0; i < sliceCount; ++i) {
+        slices[i].aWorld = aWorld;
+        slices[i].directoryFd = dirfd(dirToCheck);
+        slices[i].fileNames = fileNames;
+        slices[i].nameStarts = nameStarts;
+        slices[i].roomNames = roomNames;
+        slices[i].roomKinds = roomKinds;
+        slices[i].first = (int)((long)fileCount * i / sliceCount);
+        slices[i].last = (int)((long)fileCount * (i + 1) / sliceCount);
+    }
+    runSlices(slices, sliceCount, readSlice);
     /* close directory */
     closedir(dirToCheck);
+    free(fileNames);
+    free(nameStarts);
+    if (slicesFailed(slices, sliceCount)) {
+        flag = -1;
+    }
+    /* later slices win, as the last start or end room in the listing did */
+    for (i = 0; i < sliceCount && flag == 1; ++i) {
+        slices[i].linkBase = linkCount;
+        linkCount += slices[i].linkCount;
+        slices[i].stringBase = stringSize;
+        stringSize += slices[i].stringSize;
+        if (slices[i].startRoom != -1) {
+            aWorld->startRoom = slices[i].startRoom;
+        }
+        if (slices[i].endRoom != -1) {
+            aWorld->endRoom = slices[i].endRoom;
+        }
+    }
+    if (flag == 1 && (aWorld->startRoom == -1 || aWorld->endRoom == -1)) {
+        fprintf(stderr, "Map in %s has no start or end room\n", directoryName);
+        flag = -1;
+    }
+    if (flag == 1 && makeImage(aWorld, fileCount, linkCount, stringSize) == 0) {
+        flag = -1;
+    }
+    if (flag == 1) {
+        runSlices(slices, sliceCount, copySlice);
+        aWorld->rows[fileCount] = linkCount;
+        makeNameIndex(aWorld);
+        runSlices(slices, sliceCount, resolveSlice);
+        if (slicesFailed(slices, sliceCount)) {
+            flag = -1;
+        }
+    }
+    for (i = 0; i < sliceCount; ++i) {
+        free(slices[i].text);
+        free(slices[i].links);
+        free(slices[i].firstLink);
+    }
+    free(slices);
+    free(roomNames);
+    free(roomKinds);
+    return flag;
 }
 
 
 /*
-Reads one file where the format of that file fills in the 
-data members of a room structure
+Returns 1 if a loader phase failed on any slice, otherwise returns 0.
 */
-void readFile(char *directoryName, char *fileName, struct room *aRoom) {
-    char filePath[STR];
-    char line[STR];
-    FILE *reader;
-
-    memset(filePath, '\0', STR);
-    memset(line, '\0', STR);
-    strcpy(filePath, fileName);
-   /* generate filePath */
-    createFileName(filePath, directoryName);
-   /* open file */
-   reader = fopen(filePath, "r");
-   /* check file */
-   if (!reader) {
-       fprintf(stderr, "Error openning file to read\n");
-       exit(EXIT_FAILURE);
-   }
-   /* read the file */
-   while(!feof(reader)) {
-       fgets(line, STR, reader);
-       readOneRoom(reader, aRoom, line);
-       fgets(line, STR, reader);
-   }
-   /* close the file */
-   fclose(reader);
-}
-
-
-/*
-Reads each line in a file and stores the data in a data member
-of a room structure
-*/
-void readOneRoom(FILE *reader,struct room *aRoom, char *line) {
-    int i = 0;
+int slicesFailed(struct loadSlice *slices, int sliceCount) {
+    int i;
 
-    /* since name is already read, copy name to room */
-    aRoom->name = getString(getData(line));
-    /* now reading connection data on file */
-    fgets(line, STR, reader);
-    while (strstr(line, "CONNECTION") && i < CONN_SZ) {
-        aRoom->connections[i] = getString(getData(line));
-        ++aRoom->connectCount;
-        ++i;
-        fgets(line, STR, reader);
-    }
-    /* room type should be the line just read */
-    if (strstr(line, "ROOM TYPE")) {
-        aRoom->roomType = getString(getData(line));
-    } else {
-        fprintf(stderr, "Unable to read room type from file\n");
-        exit(EXIT_FAILURE);
+    for (i = 0; i < sliceCount; ++i) {
+        if (slices[i].failed) {
+            return 1;
+        }
     }
+    return 0;
 }
 
 
 /*
-Combines a directory name, filename, and a room name to a file path 
+Allocates the image of a map with room files' counts and sizes, laid out
+as lindorg.buildrooms writes a map file, and points the world's sections
+into it.  Only the header is filled in.
+Returns 1 if the image is made, returns 0 if the map is too large for the
+format.
 */
-void createFileName(char *fileName, char *directoryName) {
-    char fowardSlash[2] = "/";
-    char tempPath[STR];
-    
-    memset(tempPath, '\0', STR);
-    /* copy directory name to file name */
-    strcpy(tempPath, directoryName);
-    /* concatenate the forward slash */
-    strcat(tempPath, fowardSlash);
-    /* concatenate the file name */
-    strcat(tempPath, fileName); 
-    memset(fileName, '\0', STR);
-    strcpy(fileName, tempPath);
+int makeImage(struct world *aWorld, int roomCount, size_t edgeCount, size_t stringSize) {
+    struct mapHeader header;
+
+    if (edgeCount > INT32_MAX || stringSize > UINT32_MAX) {
+        fprintf(stderr, "Map is too large\n");
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_MAGIC, sizeof(header.magic));
+    header.version = MAP_VERSION;
+    header.roomCount = roomCount;
+    header.edgeCount = edgeCount;
+    header.startRoom = aWorld->startRoom;
+    header.endRoom = aWorld->endRoom;
+    header.stringSize = stringSize;
+    header.typeOffset = sizeof(header);
+    header.nameOffset = alignOffset(header.typeOffset + roomCount);
+    header.rowOffset = alignOffset(header.nameOffset + roomCount * sizeof(uint32_t));
+    header.edgeOffset = alignOffset(header.rowOffset + (roomCount + 1) * sizeof(uint32_t));
+    header.stringOffset = alignOffset(header.edgeOffset + edgeCount * sizeof(int32_t));
+    header.fileSize = header.stringOffset + stringSize;
+    aWorld->imageSize = header.fileSize;
+    aWorld->image = (char *)calloc(1, aWorld->imageSize);
+    assert(aWorld->image != 0);
+    memcpy(aWorld->image, &header, sizeof(header));
+    aWorld->mapped = 0;
+    pointSections(aWorld);
+    return 1;
 }
 
 
 /*
-Tokenize a string, and returns one word
+Points the world's sections at the parts of its image the header names.
 */
-char *getData(char *line) {
-    char *result = NULL;
+void pointSections(struct world *aWorld) {
+    struct mapHeader *header = (struct mapHeader *)aWorld->image;
+
+    aWorld->roomCount = header->roomCount;
+    aWorld->types = (unsigned char *)(aWorld->image + header->typeOffset);
+    aWorld->names = (uint32_t *)(aWorld->image + header->nameOffset);
+    aWorld->rows = (uint32_t *)(aWorld->image + header->rowOffset);
+    aWorld->edges = (int32_t *)(aWorld->image + header->edgeOffset);
+    aWorld->strings = aWorld->image + header->stringOffset;
+}
 
-    result = strtok(line, " ");
-    result = strtok(NULL, " ");
-    result = strtok(NULL, "\n");
-    return result;
+
+/*
+Returns an offset rounded up to the next multiple of 8, as map sections are.
+*/
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
 }
 
 
 /*
-Copies a string data and returns the string to destination
+Returns how many threads should load fileCount room files: one per
+LOAD_FILES files, at most one per online processor and at least one.
 */
-char *getString(char *data) {
-    char *newStr = NULL;
-    int size = strlen(data) + 1;
+int countLoadThreads(int fileCount) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = fileCount / LOAD_FILES;
 
-    if (size == 1) { return NULL; }
-    newStr = (char *)malloc(size * sizeof(char));
-    assert (newStr != 0);
-    strcpy(newStr, data);
-    return newStr;
+    if (processors > 0 && threadCount > processors) {
+        threadCount = (int)processors;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    return threadCount;
 }
 
 
+/*
+Runs one phase of the loader: body on every slice, each on its own thread.
+A single slice runs on the calling thread.
+*/
+void runSlices(struct loadSlice *slices, int sliceCount, void *(*body)(void *)) {
+    pthread_t *threads = NULL;
+    int i;
+    int resultCode;
+
+    if (sliceCount == 1) {
+        body(&slices[0]);
+        return;
+    }
+    threads = (pthread_t *)malloc(sliceCount * sizeof(pthread_t));
+    assert(threads != 0);
+    for (i = 0; i < sliceCount; ++i) {
+        resultCode = pthread_create(&threads[i], NULL, body, &slices[i]);
+        assert(0 == resultCode);
+    }
+    for (i = 0; i < sliceCount; ++i) {
+        resultCode = pthread_join(threads[i], NULL);
+        assert(0 == resultCode);
+    }
+    free(threads);
+}
 
-/* Create a list of room struct pointers */
-struct room **makeRoomList() {
-    int i, j;
 
-    struct room **list = (struct room **)malloc(SELECTED * sizeof(struct room*));
-    assert(list != 0);
-    for (i = 0; i < SELECTED; ++i) {
-        list[i] = (struct room*)malloc(sizeof(struct room));
-        assert(list[i] != 0);
-        list[i]->name = NULL;
-        list[i]->connectCount = 0;
-        /* allocate the six connections */
-        list[i]->connections = (char **)malloc(CONN_SZ * sizeof(char*));
-        assert(list[i]->connections != 0); 
-        for (j = 0; j < CONN_SZ; ++j) {
-            list[i]->connections[j] = NULL;
+/*
+First loader phase: reads the room files of a slice into its buffer, one
+read per file.  Each file is followed by a newline so its last line ends like
+the others; the buffer is then parsed in place.  A file that cannot be read
+or parsed marks the slice failed.
+*/
+void *readSlice(void *argument) {
+    struct loadSlice *slice = (struct loadSlice *)argument;
+    struct stat attributes;
+    size_t *starts = NULL;
+    size_t used = 0, capacity = 0;
+    char *fileName;
+    ssize_t size;
+    int fd, i;
+
+    slice->text = NULL;
+    slice->links = NULL;
+    slice->firstLink = NULL;
+    slice->failed = 0;
+    /* one more start than files marks the end of the last file */
+    starts = (size_t *)malloc((slice->last - slice->first + 1) * sizeof(size_t));
+    assert(starts != 0);
+    for (i = slice->first; i < slice->last; ++i) {
+        fileName = slice->fileNames + slice->nameStarts[i];
+        fd = openat(slice->directoryFd, fileName, O_RDONLY);
+        if (fd == -1 || fstat(fd, &attributes) == -1) {
+            fprintf(stderr, "Error openning file to read\n");
+            if (fd != -1) {
+                close(fd);
+            }
+            slice->failed = 1;
+            free(starts);
+            return NULL;
         }
-        list[i]->roomType = NULL;
+        if (used + attributes.st_size + 1 > capacity) {
+            capacity = 2 * (used + attributes.st_size + 1);
+            slice->text = (char *)realloc(slice->text, capacity);
+            assert(slice->text != 0);
+        }
+        starts[i - slice->first] = used;
+        size = readAll(fd, slice->text + used, attributes.st_size);
+        close(fd);
+        if (size == -1) {
+            fprintf(stderr, "Error reading %s\n", fileName);
+            slice->failed = 1;
+            free(starts);
+            return NULL;
+        }
+        used += size;
+        slice->text[used++] = '\n';
     }
-    return list;
+    starts[slice->last - slice->first] = used;
+    if (parseRoomFiles(slice, starts) == 0) {
+        slice->failed = 1;
+    }
+    free(starts);
+    return NULL;
 }
 
 
-/* deallocate all memory from the list */
-void destroyList(struct room **list) {
-    int index;
-    int j;
-    if (list) {
-        for (index = 0; index < SELECTED; ++index) {
-            /* go through each index and remove all connections */
-            if (list[index] && list[index]->connections) {
-                for (j = 0; j < CONN_SZ; ++j) {
-                    if (list[index]->connections[j]) {
-                        free(list[index]->connections[j]);
-                        list[index]->connections[j] = NULL;
+/*
+Parses the room files of a slice, read into its buffer, in one pass.  Each
+line is "KEY: value"; the newline ending the value becomes its NUL.  Room
+names are kept where they lie, room types are parsed to their enum and the
+slice's start and end rooms are recorded.  Connection names are kept in the
+slice's links until resolveSlice turns them into indices.
+Returns 1 if every room file has a name and a room type, otherwise returns 0.
+*/
+int parseRoomFiles(struct loadSlice *slice, size_t *starts) {
+    char *line, *end, *next, *value, *name;
+    size_t linkCapacity;
+    int i, type;
+
+    slice->linkCount = 0;
+    slice->stringSize = 0;
+    slice->startRoom = -1;
+    slice->endRoom = -1;
+    slice->firstLink = (size_t *)malloc((slice->last - slice->first + 1) * sizeof(size_t));
+    assert(slice->firstLink != 0);
+    linkCapacity = (size_t)CONN_SZ * (slice->last - slice->first + 1);
+    slice->links = (char **)malloc(linkCapacity * sizeof(char *));
+    assert(slice->links != 0);
+    for (i = slice->first; i < slice->last; ++i) {
+        name = NULL;
+        type = -1;
+        slice->firstLink[i - slice->first] = slice->linkCount;
+        line = slice->text + starts[i - slice->first];
+        end = slice->text + starts[i - slice->first + 1];
+        while (line < end) {
+            /* every line ends with a newline, the last one included */
+            next = (char *)memchr(line, '\n', end - line);
+            *next = '\0';
+            value = strstr(line, ": ");
+            if (value) {
+                value += 2;
+                if (strncmp(line, "ROOM NAME", 9) == 0) {
+                    name = value;
+                } else if (strncmp(line, "CONNECTION", 10) == 0) {
+                    if (slice->linkCount == linkCapacity) {
+                        linkCapacity *= 2;
+                        slice->links = (char **)realloc(slice->links, linkCapacity * sizeof(char *));
+                        assert(slice->links != 0);
                     }
+                    slice->links[slice->linkCount++] = value;
+                } else if (strncmp(line, "ROOM TYPE", 9) == 0) {
+                    type = parseRoomType(value);
                 }
-                free(list[index]->connections);
-                list[index]->connections = NULL;
-            }
-            if (list[index]) {
-                /* delete name */
-                if (list[index]->name) { free(list[index]->name); }
-                list[index]->name = NULL;
-                /* delete room type */
-                if (list[index]->roomType) { free(list[index]->roomType); }
-                list[index]->roomType = NULL;
-                /* reset connection count */
-                list[index]->connectCount = 0;
-                /* delete room */
-                free(list[index]);
-                list[index] = NULL;
             }
+            line = next + 1;
+        }
+        if (!name || type == -1) {
+            fprintf(stderr, "Unable to read room type from file\n");
+            return 0;
+        }
+        slice->roomNames[i] = name;
+        slice->roomKinds[i] = type;
+        slice->stringSize += strlen(name) + 1;
+        if (type == START_ROOM) {
+            slice->startRoom = i;
+        } else if (type == END_ROOM) {
+            slice->endRoom = i;
+        }
+    }
+    return 1;
+}
+
+
+/*
+Second loader phase: copies the names, types and rows of a slice's rooms into
+the map image.
+*/
+void *copySlice(void *argument) {
+    struct loadSlice *slice = (struct loadSlice *)argument;
+    struct world *aWorld = slice->aWorld;
+    size_t offset = slice->stringBase, size;
+    int i;
+
+    for (i = slice->first; i < slice->last; ++i) {
+        size = strlen(slice->roomNames[i]) + 1;
+        memcpy(aWorld->strings + offset, slice->roomNames[i], size);
+        aWorld->names[i] = offset;
+        offset += size;
+        aWorld->types[i] = slice->roomKinds[i];
+        aWorld->rows[i] = slice->linkBase + slice->firstLink[i - slice->first];
+    }
+    return NULL;
+}
+
+
+/*
+Last loader phase: resolves the connection names of a slice to room indices
+through the (read only) name index, into the slice's part of the edges.  A
+connection to no room marks the slice failed.
+*/
+void *resolveSlice(void *argument) {
+    struct loadSlice *slice = (struct loadSlice *)argument;
+    struct world *aWorld = slice->aWorld;
+    int32_t *edges = aWorld->edges + slice->linkBase;
+    size_t j;
+
+    for (j = 0; j < slice->linkCount; ++j) {
+        edges[j] = findRoom(aWorld, slice->links[j]);
+        if (edges[j] == -1) {
+            fprintf(stderr, "Unable to find the room %s\n", slice->links[j]);
+            slice->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+Converts the value of a ROOM TYPE line to a room type.
+Returns the room type, or -1 if the value names none.
+*/
+int parseRoomType(char *value) {
+    int type;
+
+    for (type = MID_ROOM; type <= END_ROOM; ++type) {
+        if (strcmp(value, roomTypes[type]) == 0) {
+            return type;
         }
-        /* delete list */
-        free(list);
-        list = NULL;
     }
+    return -1;
 }
 
+
+/*
+Reads up to size bytes of a file, however many calls it takes.
+Returns the number of bytes read, or -1 on error.
+*/
+ssize_t readAll(int fd, char *data, size_t size) {
+    size_t total = 0;
+    ssize_t got;
+
+    while (total < size) {
+        got = read(fd, data + total, size - total);
+        if (got == -1) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        total += got;
+    }
+    return total;
+}
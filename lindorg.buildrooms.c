@@ -2,14 +2,61 @@
  NAME: lindorg.buildrooms.c
 
  SYNOPSIS:  To compile program ...
-    gcc -o lindorg.buildrooms lindorg.buildrooms.c
- 
+    gcc -o lindorg.buildrooms lindorg.buildrooms.c -lpthread
+
+    To run the program ...
+    lindorg.buildrooms [-n rooms] [-m minConnections] [-x maxConnections] [-g classic|constructive]
+                       [-d dictionary] [-b] [-s seed] [-N maps] [-t threads] [-f]
+                       [-D distance] [-B json|csv] [-S shardRooms] [-M metrics]
+
  DESCRIPTION:
     This program implements a graph to form connections between seven randomly selected rooms out
     of ten total rooms.
     Each room are connected between 3 to 6 other rooms.
+    The number of rooms and the connection bounds can be changed with the -n, -m and -x options.
+    Room names are drawn without repeats from a name pool: the ten built-in names, or the
+    words of a dictionary file given with -d (one name per line, words the game reads as
+    commands, such as "time", are skipped).  Worlds larger than the
+    pool get a word plus a number (e.g. "Gallery12") for the remaining rooms.
+    Connections are kept in a compressed sparse row (CSR) store: one array of room ids where
+    each room owns a contiguous slice.  Rooms, names and connections are all carved from one
+    arena per world, so a world costs a few large allocations and is freed all at once.
+    The classic generator picks random pairs of rooms until a valid one turns up; when no
+    valid pair is left it rewires connections like the constructive generator.  The
+    constructive generator (-g constructive) only draws from rooms that still have free
+    connection slots, so it runs in near-linear time on large worlds.
+    Rooms with more than 512 connection slots check for duplicate connections in a bit matrix
+    (small worlds) or a hash set of room pairs instead of scanning their slots, and the rooms
+    still below the minimum are counted as connections are made, so no check visits every room.
+    Connected groups of rooms are tracked with a union-find as connections are added.  The
+    start room is placed in the largest group and a breadth first search from it places the
+    end room at least -D moves away (default 1), so every map can be solved.
     The Program creates a directory named "lindorg.buildrooms", and in the directory,
     the program writes seven files where each files contains data of one room.
+    With -b the directory instead holds a single binary map file, "rooms.map", that
+    lindorg.adventure maps into memory and uses in place (see struct mapHeader).
+    Every map has its own random number generator seeded from -s (default: clock and pid),
+    so the same seed always builds the same map.  -N builds a batch of maps on -t worker
+    threads into lindorg.rooms.<pid>.<map>; map k of a batch only depends on the seed and k.
+    A map is written into a lindorg.staging.<pid> directory first (each file in one write,
+    fsync'ed with -f) and then renamed to lindorg.rooms.<pid>, so readers never see a
+    partial map.  The symbolic link lindorg.rooms.latest is then swapped (by rename) to
+    point at the map just published, so lindorg.adventure finds it without a scan.
+    -B runs a benchmark instead of publishing maps: for 10, 100, ... rooms up to -n and for
+    every maximum from -m + 1 to -x connections, -N maps are generated and written to a
+    staging directory that is then removed.  One record per map goes to stdout, as JSON or
+    CSV, with the time and heap allocations of each phase (names, graph, compact, place,
+    write), the random draws that had to be retried, and the arena chunks used.
+    -S builds a binary map (-b) larger than memory in shards of about shardRooms rooms.  Each
+    shard is generated, linked to the previous shard by up to four connections and written to
+    the map file before the next one starts, so only one shard and the pending links are in
+    memory.
+    The start room is in the first shard and the end room in the last; sharded names are a
+    word plus a number.
+    -M keeps runtime metrics and writes them to the file named, in the Prometheus text
+    format, on exit and whenever the program gets SIGUSR1: a latency histogram per phase,
+    the maps built and failed, their rooms and connections, the random draws retried and
+    the heap allocations.  The file is replaced by rename, so a scraper never reads half of it.
 
  AUTHOR:  Gerson Lindor Jr.
  DATE CREATED: January 26, 2020
@@ -20,282 +67,2314 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <signal.h>
 
 #define SIZE 10
 #define SELECTED 7
-#define NAME_SZ 9
+#define NAME_LEN 20
 #define CONN_SZ 6
 #define MIN 3
 #define STR 100
+#define CLASSIC 0
+#define CONSTRUCTIVE 1
+#define PICK_TRIES 16
+#define MAX_REWIRES (1L << 30)
+#define MAP_FILENAME "rooms.map"
+#define ROOMS_PREFIX "lindorg.rooms."
+#define STAGING_PREFIX "lindorg.staging."
+#define LATEST_LINK "lindorg.rooms.latest"
+#define MAP_MAGIC "LNDGMAP"
+#define MAP_VERSION 1
+#define ARENA_CHUNK (1 << 20)
+#define LATENCY_BUCKETS 10
+#define EDGE_BITS_LIMIT (1 << 23)
+#define EDGE_SCAN_DEGREE 512
+#define RESERVED_WORDS 1
+#define SHARD_LINKS 4
+#define SHARD_FRONTIER 1024
+
+enum roomType { MID_ROOM, START_ROOM, END_ROOM };
+enum phase { NAMES_PHASE, GRAPH_PHASE, COMPACT_PHASE, PLACE_PHASE, WRITE_PHASE, PHASES };
+enum reportFormat { NO_REPORT, JSON_REPORT, CSV_REPORT };
+enum edgeIndex { EDGE_SCAN, EDGE_BITS, EDGE_HASH };
 
 struct room {
     int id;
     char *name;
     int connectCount;
-    struct room **connections;
-    char *roomType;
+    int roomType;
+};
+
+/*
+ Header of one block of arena memory, the block's data follows it.
+*/
+struct arenaChunk {
+    struct arenaChunk *previous;
+    size_t size;
+};
+
+/*
+ A bump allocator for everything a world keeps until it is destroyed: rooms,
+ names and connections.  Memory comes from a few large chunks and is only
+ released all at once by destroyArena.
+*/
+struct arena {
+    struct arenaChunk *chunks;
+    char *next;
+    size_t left;
+    int chunkCount;
+};
+
+/*
+ A splitmix64 random number generator.  Each map owns one, so worker threads
+ never share random state.
+*/
+struct prng {
+    uint64_t state;
+};
+
+/*
+ What building one map cost: the milliseconds and heap allocations of each
+ phase and the random draws that had to be made again.
+*/
+struct counters {
+    double phaseTime[PHASES];
+    long phaseAllocations[PHASES];
+    long nameRetries;
+    long pickRetries;
+    long rewires;
+    long placeRetries;
+    int arenaChunks;
+};
+
+/*
+ The connections of a world while its graph is built, so a duplicate check
+ takes constant time when rooms have more than EDGE_SCAN_DEGREE slots; with
+ fewer, scanning the room's own slots is cheaper and no set is kept.  Worlds
+ whose bit matrix (one bit per ordered pair of rooms) fits in EDGE_BITS_LIMIT
+ bytes use it, larger ones an open addressing hash set of room pairs (mask + 1
+ slots, lower id in the high half, 0 is empty).
+*/
+struct edgeSet {
+    int kind;
+    uint64_t *words;
+    uint64_t mask;
+};
+
+/*
+ A generated world.  While the graph is built every room owns maxDegree slots
+ in adjacent (room id * maxDegree); compactGraph then packs the slots into CSR
+ form where room i owns adjacent[rowStart[i]] .. adjacent[rowStart[i + 1] - 1].
+*/
+struct world {
+    int roomCount;
+    int minDegree;
+    int maxDegree;
+    int generator;
+    struct prng rng;
+    struct room **list;
+    int *adjacent;
+    int *rowStart;
+    int startRoom;
+    int endRoom;
+    int minDistance;
+    int *parent;
+    int *groupSize;
+    int groupCount;
+    int largestGroup;
+    struct edgeSet edges;
+    int deficientRooms;
+    struct counters stats;
+    struct arena memory;
+};
+
+/*
+ Settings that do not describe the world itself.
+*/
+struct settings {
+    char *dictionary;
+    int binary;
+    uint64_t seed;
+    int mapCount;
+    int threadCount;
+    int sync;
+    int report;
+    int shardSize;
+    char *metricsPath;
+};
+
+/*
+ Work shared by the threads of a batch.  Workers take the next map index under
+ lock until every map is built; failed counts the maps that could not be.
+*/
+struct batch {
+    struct world *template;
+    struct namePool *pool;
+    struct settings *options;
+    int processID;
+    int nextMap;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+/*
+ A latency histogram: counts[i] observations took at most latencyBounds[i]
+ seconds and more than the bound before it (the last bucket has no bound),
+ sumNanos is their total.
+*/
+struct histogram {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long long sumNanos;
+};
+
+/*
+ Runtime metrics, kept while path names the file they are exported to (-M).
+ Workers update them with relaxed atomics; the metrics thread writes them out
+ on SIGUSR1 and once more when stop is set.
+*/
+struct metrics {
+    char *path;
+    pthread_t thread;
+    int stop;
+    struct histogram phaseSeconds[PHASES];
+    unsigned long maps;
+    unsigned long failedMaps;
+    unsigned long rooms;
+    unsigned long edges;
+    unsigned long nameRetries;
+    unsigned long pickRetries;
+    unsigned long rewires;
+    unsigned long placeRetries;
+};
+
+/*
+ Header of a binary map file, lindorg.adventure reads the same layout.
+ Offsets are from the start of the file and 8 byte aligned.  The sections are:
+    types    roomCount bytes: MID_ROOM, START_ROOM or END_ROOM
+    names    roomCount uint32 offsets into strings
+    rows     roomCount + 1 uint32 CSR offsets into edges
+    edges    edgeCount int32 room indices
+    strings  stringSize bytes of NUL terminated room names
+*/
+struct mapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t roomCount;
+    uint32_t edgeCount;
+    int32_t startRoom;
+    int32_t endRoom;
+    uint32_t stringSize;
+    uint64_t typeOffset;
+    uint64_t nameOffset;
+    uint64_t rowOffset;
+    uint64_t edgeOffset;
+    uint64_t stringOffset;
+    uint64_t fileSize;
+};
+
+/*
+ Where the next shard of a sharded map goes in the map file: its first room
+ and the edges and string bytes written before it.  exitRooms are the
+ exitCount rooms of the previous shard waiting for a connection into this
+ shard, the first one reachable from that shard's entry, and exitSlots the
+ file offsets where those connections are written.  stats sums the phases and
+ retried draws of the whole map.
+*/
+struct shardCursor {
+    int base;
+    uint32_t edgeCount;
+    uint32_t stringSize;
+    int exitRooms[SHARD_LINKS];
+    uint64_t exitSlots[SHARD_LINKS];
+    int exitCount;
+    struct counters stats;
+};
+
+/*
+ A set of room ids with O(1) insert and removal.  position[id] is the index of
+ id in members, or -1 when the room is not in the set.
+*/
+struct roomSet {
+    int count;
+    int *members;
+    int *position;
+};
+
+/*
+ The words room names are drawn from.  text holds the dictionary file the
+ words point into, or NULL for the built-in word bank.
+*/
+struct namePool {
+    int count;
+    char **words;
+    char *text;
 };
 
+/*
+ An open addressing hash set of the room names already used.  The set does not
+ own the names; mask + 1 is the (power of two) number of slots.
+*/
+struct nameSet {
+    unsigned int mask;
+    char **slots;
+};
 
-int makeDir(char * directoryName, int pid);
-int writeFile(char *directoryName, struct room **list);
-void createGraph(struct room **list);
-int  isGraphFull(struct room **list);
-void addRandomConnection();
-char *roomBank(struct room **list);
-int duplicateRooms(struct room **list, char *search);
-struct room *getRandomRoom(struct room **list);
-int canAddConnectionFrom(struct room *roomX);
-int connectionAlreadyExists(struct room *roomX, struct room *roomY);
-void destroyList(struct room **list);
+static const char *roomTypeNames[3] = { "MID_ROOM", "START_ROOM", "END_ROOM" };
+
+static const char *phaseNames[PHASES] = { "names", "graph", "compact", "place", "write" };
+
+/* heap allocations made by the generator, shared by every thread */
+static long allocationCount = 0;
+
+static const double latencyBounds[LATENCY_BUCKETS - 1] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2,
+                                                           0.1, 1.0, 10.0, 100.0 };
+
+/* the metrics of the whole program, whatever thread records them */
+static struct metrics buildMetrics;
+
+static const char *wordBank[SIZE] = { "Gallery", "Ballroom", "Billiard"
+                                    , "Library", "Office", "Armory"
+                                    , "Stables", "Chambers", "Kitchen", "Theater" };
+
+/* what lindorg.adventure reads as a command rather than a room name */
+static const char *reservedWords[RESERVED_WORDS] = { "time" };
+
+
+int parseOptions(int argc, char *argv[], struct world *aWorld, struct settings *options);
+int buildMap(struct world *template, struct namePool *pool, struct settings *options, int pid, int mapIndex,
+             struct counters *report);
+int runBenchmark(struct world *template, struct namePool *pool, struct settings *options, int pid);
+int buildShardedMap(struct world *template, struct namePool *pool, struct settings *options, int pid, int mapIndex);
+int buildShard(int fd, struct world *shard, char **order, int wordCount, struct mapHeader *header,
+               struct shardCursor *cursor, int last);
+int writeShard(int fd, struct world *shard, struct mapHeader *header, struct shardCursor *cursor);
+void endShard(struct world *shard, struct shardCursor *cursor);
+int pickLinkRooms(struct world *shard, int *picked, int count, int want, int limit);
+int shardWords(struct world *aWorld, struct namePool *pool, char ***order);
+void nameShard(struct world *shard, char **order, int wordCount, int base);
+uint64_t shardStringSize(char **order, int wordCount, int roomCount);
+uint64_t digitTotal(uint64_t last);
+int writeAt(int fd, void *data, size_t size, uint64_t offset);
+void printRecord(struct world *cell, struct settings *options, struct counters *stats, int mapIndex, int first);
+void endPhase(struct world *aWorld, int phase, double *started, long *allocated);
+double chargePhase(struct counters *stats, int phase, double *started, long *allocated);
+double readClock(void);
+void countAllocation(void);
+void startMetrics(char *path);
+void stopMetrics(void);
+void *runMetrics(void *argument);
+void recordLatency(struct histogram *latency, double seconds);
+void recordMap(struct counters *stats, int roomCount, long edgeCount, int built);
+void addMetric(unsigned long *counter, unsigned long amount);
+void writeMetrics(void);
+void writeCounter(FILE *stream, char *name, char *type, char *help, unsigned long value);
+void *buildWorker(void *argument);
+int buildBatch(struct world *template, struct namePool *pool, struct settings *options, int pid);
+void seedRandom(struct prng *rng, uint64_t seed, uint64_t stream);
+uint64_t nextRandom(struct prng *rng);
+int randomBelow(struct prng *rng, int bound);
+int makeDir(char * directoryName, int pid, int mapIndex);
+int publishDir(char *stagingName, int sync);
+int pointLatest(char *directoryName);
+void removeStaging(char *stagingName);
+int syncPath(char *path);
+int writeFile(char *directoryName, struct world *aWorld, int sync);
+int writeMapFile(char *directoryName, struct world *aWorld, int sync);
+int writeAll(int fd, void *data, size_t size);
+uint64_t alignOffset(uint64_t offset);
+int createGraph(struct world *aWorld);
+int createGraphConstructive(struct world *aWorld);
+int completeGraph(struct world *aWorld, struct roomSet *open, struct roomSet *deficient);
+int pickPartner(struct world *aWorld, struct roomSet *open, struct room *roomA);
+int rewireFor(struct world *aWorld, struct roomSet *open, struct roomSet *deficient, struct room *roomA);
+void updateSets(struct world *aWorld, struct roomSet *open, struct roomSet *deficient, struct room *aRoom);
+void disconnectRoom(struct world *aWorld, struct room *roomX, struct room *roomY);
+void makeRoomSet(struct roomSet *set, int roomCount);
+void destroyRoomSet(struct roomSet *set);
+void addToSet(struct roomSet *set, int id);
+void removeFromSet(struct roomSet *set, int id);
+int  isGraphFull(struct world *aWorld);
+void roomBank(struct world *aWorld, struct namePool *pool);
+int duplicateRooms(struct nameSet *used, char *search);
+int loadNamePool(struct namePool *pool, char *fileName);
+void defaultNamePool(struct namePool *pool);
+void destroyNamePool(struct namePool *pool);
+int isValidName(char *word);
+void makeNameSet(struct nameSet *set, int expected);
+void destroyNameSet(struct nameSet *set);
+unsigned int hashName(char *name);
+struct room *getRandomRoom(struct world *aWorld);
+int canAddConnectionFrom(struct world *aWorld, struct room *roomX);
+int connectionAlreadyExists(struct world *aWorld, struct room *roomX, struct room *roomY);
+void makeEdgeSet(struct world *aWorld);
+void destroyEdgeSet(struct world *aWorld);
+void addEdge(struct world *aWorld, int idX, int idY);
+void removeEdge(struct world *aWorld, int idX, int idY);
+uint64_t *findEdge(struct world *aWorld, uint64_t key);
+uint64_t edgeKey(int idX, int idY);
+uint64_t hashEdge(uint64_t key);
 int isSameRoom(struct room *roomX, struct room *roomY);
-void connectRoom( struct room *roomX, struct room *roomY);
-void addRandomConnection(struct room **list);
-struct room **makeRoomList();
-void destroyList(struct room **list);
-void makeRandomList(struct room **list);
-void writeOneRoom(FILE *stream,struct room *aRoom);
+void connectRoom(struct world *aWorld, struct room *roomX, struct room *roomY);
+int addRandomConnection(struct world *aWorld);
+int *getConnections(struct world *aWorld, struct room *aRoom);
+void compactGraph(struct world *aWorld);
+void makeWorld(struct world *aWorld);
+void destroyWorld(struct world *aWorld);
+struct room **makeRoomList(struct arena *memory, int roomCount);
+void makeArena(struct arena *memory, size_t size);
+void addArenaChunk(struct arena *memory, size_t size);
+void *arenaAlloc(struct arena *memory, size_t size);
+char *arenaString(struct arena *memory, char *data);
+void destroyArena(struct arena *memory);
+char **findName(struct nameSet *used, char *search);
+void makeRandomList(struct world *aWorld, struct namePool *pool);
+void writeOneRoom(FILE *stream, struct world *aWorld, struct room *aRoom);
 void createFileName(char *fileName, char *directoryName, struct room *aRoom);
-char *getString(char *data);
-void createStartAndEnd(struct room **list);
+int createStartAndEnd(struct world *aWorld);
+int placeEnd(struct world *aWorld, int head, int minDistance, int needSlot, int *distance, int *queue);
+int pickRoomInLargestGroup(struct world *aWorld, int needSlot);
+int findGroup(struct world *aWorld, int id);
+void joinGroups(struct world *aWorld, int idX, int idY);
+
+
+
+int main(int argc, char *argv[]) {
+    struct world aWorld;
+    struct namePool pool;
+    struct settings options;
+    int processID = getpid();
+    int flag;
+
+    if (parseOptions(argc, argv, &aWorld, &options) == 0) {
+        fprintf(stderr, "usage: %s [-n rooms] [-m minConnections] [-x maxConnections]"
+                        " [-g classic|constructive] [-d dictionary] [-b] [-s seed]"
+                        " [-N maps] [-t threads] [-f] [-D distance] [-B json|csv]"
+                        " [-S shardRooms] [-M metrics]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* before the workers start, so they all leave SIGUSR1 to it */
+    if (options.metricsPath) {
+        startMetrics(options.metricsPath);
+    }
+    if (options.dictionary) {
+        if (loadNamePool(&pool, options.dictionary) == 0) {
+            fprintf(stderr, "Unable to read room names from %s\n", options.dictionary);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        defaultNamePool(&pool);
+    }
+    if (options.report != NO_REPORT) {
+        flag = runBenchmark(&aWorld, &pool, &options, processID);
+    } else if (options.mapCount == 1) {
+        flag = buildMap(&aWorld, &pool, &options, processID, -1, NULL);
+    } else {
+        flag = buildBatch(&aWorld, &pool, &options, processID);
+    }
+    destroyNamePool(&pool);
+    stopMetrics();
+    if (flag == 0) {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+
+/*
+Generates one map from the template settings and writes it to its directory,
+lindorg.rooms.<pid>, or lindorg.rooms.<pid>.<mapIndex> for a map of a batch.
+The map's random numbers only depend on the seed and the map index.
+Each phase is timed into the world's counters.  When report is not NULL the
+counters are copied to it and the staging directory is removed instead of
+published.
+Returns 1 if the map is written, otherwise returns 0.
+*/
+int buildMap(struct world *template, struct namePool *pool, struct settings *options, int pid, int mapIndex,
+             struct counters *report) {
+    struct world aWorld = *template;
+    char stagingName[STR] = STAGING_PREFIX;
+    int flag = 1;
+    double started = readClock();
+    long allocated = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+
+    if (options->shardSize > 0 && template->roomCount > options->shardSize) {
+        return buildShardedMap(template, pool, options, pid, mapIndex);
+    }
+    seedRandom(&aWorld.rng, options->seed, mapIndex < 0 ? 0 : mapIndex);
+    /* initialize a list of rooms and the connection store */
+    makeWorld(&aWorld);
+    /* generate rooms and make connections */
+    makeRandomList(&aWorld, pool);
+    endPhase(&aWorld, NAMES_PHASE, &started, &allocated);
+    if (aWorld.generator == CONSTRUCTIVE) {
+        if (createGraphConstructive(&aWorld) == 0) {
+            fprintf(stderr, "Unable to connect the rooms with these connection bounds\n");
+            recordMap(NULL, 0, 0, 0);
+            destroyWorld(&aWorld);
+            return 0;
+        }
+    } else {
+        if (createGraph(&aWorld) == 0) {
+            fprintf(stderr, "Unable to connect the rooms with these connection bounds\n");
+            recordMap(NULL, 0, 0, 0);
+            destroyWorld(&aWorld);
+            return 0;
+        }
+    }
+    endPhase(&aWorld, GRAPH_PHASE, &started, &allocated);
+    compactGraph(&aWorld);
+    endPhase(&aWorld, COMPACT_PHASE, &started, &allocated);
+    if (createStartAndEnd(&aWorld) == 0) {
+        fprintf(stderr, "Unable to place the end room %d moves from the start room\n", aWorld.minDistance);
+        recordMap(NULL, 0, 0, 0);
+        destroyWorld(&aWorld);
+        return 0;
+    }
+    endPhase(&aWorld, PLACE_PHASE, &started, &allocated);
+    /* create the staging directory */
+    if (makeDir(stagingName, pid, mapIndex) == -1) {
+        fprintf(stderr, "Unable to create the staging directory %s\n", stagingName);
+        flag = 0;
+    } else {
+        /* generate files in the directory, then publish it under its final name */
+        if (options->binary) {
+            flag = writeMapFile(stagingName, &aWorld, options->sync);
+        } else {
+            flag = writeFile(stagingName, &aWorld, options->sync);
+        }
+        endPhase(&aWorld, WRITE_PHASE, &started, &allocated);
+        if (flag && report) {
+            aWorld.stats.arenaChunks = aWorld.memory.chunkCount;
+            *report = aWorld.stats;
+            removeStaging(stagingName);
+        } else if (flag) {
+            flag = publishDir(stagingName, options->sync);
+        }
+        if (flag == 0) {
+            fprintf(stderr, "Unable to write the map in %s\n", stagingName);
+            removeStaging(stagingName);
+        }
+    }
+    recordMap(&aWorld.stats, aWorld.roomCount, aWorld.rowStart[aWorld.roomCount], flag);
+    destroyWorld(&aWorld);
+    return flag;
+}
+
+
+/*
+Thread body of a batch: builds maps until the batch runs out of map indices.
+*/
+void *buildWorker(void *argument) {
+    struct batch *work = (struct batch *)argument;
+    int mapIndex;
+
+    while (1) {
+        pthread_mutex_lock(&work->lock);
+        mapIndex = work->nextMap;
+        if (mapIndex < work->options->mapCount) {
+            ++work->nextMap;
+        } else {
+            mapIndex = -1;
+        }
+        pthread_mutex_unlock(&work->lock);
+        if (mapIndex == -1) {
+            break;
+        }
+        if (buildMap(work->template, work->pool, work->options, work->processID, mapIndex, NULL) == 0) {
+            pthread_mutex_lock(&work->lock);
+            ++work->failed;
+            pthread_mutex_unlock(&work->lock);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+Builds mapCount maps on a pool of threadCount worker threads.  The name pool
+and the settings are shared read only.  A map that fails does not stop the
+others; the failures are counted and reported once the batch is done.
+Returns 1 if every map is written, otherwise returns 0.
+*/
+int buildBatch(struct world *template, struct namePool *pool, struct settings *options, int pid) {
+    struct batch work;
+    pthread_t *threads = NULL;
+    int i;
+    int resultCode;
+
+    work.template = template;
+    work.pool = pool;
+    work.options = options;
+    work.processID = pid;
+    work.nextMap = 0;
+    work.failed = 0;
+    pthread_mutex_init(&work.lock, NULL);
+    threads = (pthread_t *)malloc(options->threadCount * sizeof(pthread_t));
+    assert(threads != 0);
+    for (i = 0; i < options->threadCount; ++i) {
+        resultCode = pthread_create(&threads[i], NULL, buildWorker, &work);
+        assert(0 == resultCode);
+    }
+    for (i = 0; i < options->threadCount; ++i) {
+        resultCode = pthread_join(threads[i], NULL);
+        assert(0 == resultCode);
+    }
+    free(threads);
+    pthread_mutex_destroy(&work.lock);
+    if (work.failed > 0) {
+        fprintf(stderr, "%d of %d maps could not be built\n", work.failed, options->mapCount);
+    }
+    return work.failed == 0;
+}
+
+
+/*
+Builds a binary map shard by shard, so only one shard of the world is in
+memory at a time.  The sections whose size is known up front (types, names,
+rows and strings) come first in the file and the edges last, so every shard
+is written in place as soon as it is done.  Shards are linked in a chain:
+one connection goes from a room the previous shard reaches from its own
+entry (or the start room) to a room of the next shard's largest group, so
+the end room in the last shard is always reachable from the start room, and
+up to SHARD_LINKS - 1 more join other rooms with free slots on both sides.
+Returns 1 if the map is written, otherwise returns 0.
+*/
+int buildShardedMap(struct world *template, struct namePool *pool, struct settings *options, int pid, int mapIndex) {
+    struct world shard = *template;
+    struct mapHeader header;
+    struct shardCursor cursor;
+    char stagingName[STR] = STAGING_PREFIX;
+    char fileName[STR];
+    char **order = NULL;
+    uint64_t stringSize;
+    uint32_t lastRow;
+    int wordCount;
+    int shardCount = (template->roomCount + options->shardSize - 1) / options->shardSize;
+    int k;
+    int fd;
+    int flag = 1;
+    double started = readClock();
+    long allocated = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+
+    memset(&cursor, 0, sizeof(cursor));
+    seedRandom(&shard.rng, options->seed, mapIndex < 0 ? 0 : mapIndex);
+    wordCount = shardWords(&shard, pool, &order);
+    chargePhase(&cursor.stats, NAMES_PHASE, &started, &allocated);
+    if (wordCount == 0) {
+        fprintf(stderr, "A sharded map needs room names that do not end in a digit\n");
+        free(order);
+        return 0;
+    }
+    /* names, rows and edges are 32 bit offsets in a map file */
+    stringSize = shardStringSize(order, wordCount, template->roomCount);
+    if (stringSize > UINT32_MAX || (uint64_t)template->roomCount * template->maxDegree > UINT32_MAX) {
+        fprintf(stderr, "The world is too large for the map file format\n");
+        free(order);
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_MAGIC, sizeof(header.magic));
+    header.version = MAP_VERSION;
+    header.roomCount = template->roomCount;
+    header.stringSize = stringSize;
+    header.typeOffset = sizeof(header);
+    header.nameOffset = alignOffset(header.typeOffset + template->roomCount);
+    header.rowOffset = alignOffset(header.nameOffset + (uint64_t)template->roomCount * sizeof(uint32_t));
+    header.stringOffset = alignOffset(header.rowOffset + ((uint64_t)template->roomCount + 1) * sizeof(uint32_t));
+    header.edgeOffset = alignOffset(header.stringOffset + stringSize);
+    if (makeDir(stagingName, pid, mapIndex) == -1) {
+        fprintf(stderr, "Unable to write the map in %s\n", stagingName);
+        free(order);
+        return 0;
+    }
+    snprintf(fileName, STR, "%s/%s", stagingName, MAP_FILENAME);
+    fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        flag = 0;
+    }
+    /* spread the rooms evenly so the last shard is not a sliver */
+    for (k = 0; k < shardCount && flag; ++k) {
+        shard.roomCount = template->roomCount / shardCount + (k < template->roomCount % shardCount);
+        /* the end room is at least one move further per shard crossed */
+        shard.minDistance = template->minDistance > k ? template->minDistance - k : 0;
+        flag = buildShard(fd, &shard, order, wordCount, &header, &cursor, k == shardCount - 1);
+        cursor.base += shard.roomCount;
+    }
+    free(order);
+    started = readClock();
+    allocated = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+    if (fd != -1) {
+        header.edgeCount = cursor.edgeCount;
+        header.fileSize = header.edgeOffset + (uint64_t)cursor.edgeCount * sizeof(int32_t);
+        lastRow = cursor.edgeCount;
+        flag = flag && writeAt(fd, &lastRow, sizeof(lastRow), header.rowOffset + (uint64_t)template->roomCount * sizeof(uint32_t))
+                    && ftruncate(fd, header.fileSize) == 0
+                    && writeAt(fd, &header, sizeof(header), 0);
+        if (flag && options->sync && fsync(fd) == -1) {
+            flag = 0;
+        }
+        if (close(fd) == -1) {
+            flag = 0;
+        }
+    }
+    if (flag) {
+        flag = publishDir(stagingName, options->sync);
+    }
+    if (flag == 0) {
+        fprintf(stderr, "Unable to write the map in %s\n", stagingName);
+        removeStaging(stagingName);
+    }
+    chargePhase(&cursor.stats, WRITE_PHASE, &started, &allocated);
+    /* one observation per phase of the map, the sum over its shards */
+    for (k = 0; k < PHASES; ++k) {
+        recordLatency(&buildMetrics.phaseSeconds[k], cursor.stats.phaseTime[k] / 1000.0);
+    }
+    recordMap(&cursor.stats, template->roomCount, cursor.edgeCount, flag);
+    return flag;
+}
+
+
+/*
+Generates one shard, links it to the previous shard and writes it.  The
+first shard holds the start room; every other shard is entered through a
+room of its largest group, and the other exits of the previous shard are
+linked to rooms with a free slot.  The last shard places the end room, the
+others pick a room reachable from their entry and up to SHARD_LINKS - 1
+more rooms with a free slot to link to the next shard, and leave their
+connections to be written when that shard is built.
+Returns 1 if the shard is written, otherwise returns 0.
+*/
+int buildShard(int fd, struct world *shard, char **order, int wordCount, struct mapHeader *header,
+               struct shardCursor *cursor, int last) {
+    int *distance = NULL;
+    int *queue = NULL;
+    int linked[SHARD_LINKS];
+    int exits[SHARD_LINKS];
+    int exitCount = 0;
+    int i;
+    int32_t target;
+    int flag = 1;
+    double started = readClock();
+    long allocated = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+
+    makeWorld(shard);
+    nameShard(shard, order, wordCount, cursor->base);
+    chargePhase(&cursor->stats, NAMES_PHASE, &started, &allocated);
+    if (shard->generator == CONSTRUCTIVE) {
+        flag = createGraphConstructive(shard);
+    } else {
+        flag = createGraph(shard);
+    }
+    chargePhase(&cursor->stats, GRAPH_PHASE, &started, &allocated);
+    if (flag == 0) {
+        fprintf(stderr, "Unable to connect the rooms with these connection bounds\n");
+        endShard(shard, cursor);
+        return 0;
+    }
+    linked[0] = pickRoomInLargestGroup(shard, cursor->exitCount > 0);
+    if (linked[0] == -1
+        || pickLinkRooms(shard, linked, 1, cursor->exitCount, shard->roomCount) < cursor->exitCount) {
+        fprintf(stderr, "Unable to link the shard at room %d, too few rooms have a free connection\n", cursor->base);
+        endShard(shard, cursor);
+        return 0;
+    }
+    if (cursor->exitCount == 0) {
+        shard->list[linked[0]]->roomType = START_ROOM;
+        header->startRoom = linked[0];
+    }
+    /* both ends of each link between the shards */
+    for (i = 0; i < cursor->exitCount; ++i) {
+        getConnections(shard, shard->list[linked[i]])[shard->list[linked[i]]->connectCount++] = -cursor->exitRooms[i] - 1;
+        target = cursor->base + linked[i];
+        if (writeAt(fd, &target, sizeof(target), cursor->exitSlots[i]) == 0) {
+            endShard(shard, cursor);
+            return 0;
+        }
+    }
+    distance = (int *)malloc(shard->roomCount * sizeof(int));
+    assert(distance != 0);
+    countAllocation();
+    queue = (int *)malloc(shard->roomCount * sizeof(int));
+    assert(queue != 0);
+    countAllocation();
+    exits[0] = placeEnd(shard, linked[0], last ? shard->minDistance : 0, !last, distance, queue);
+    free(distance);
+    free(queue);
+    if (exits[0] == -1) {
+        fprintf(stderr, "Unable to place the %s room in the shard at room %d\n", last ? "end" : "exit", cursor->base);
+        endShard(shard, cursor);
+        return 0;
+    }
+    if (last) {
+        shard->list[exits[0]]->roomType = END_ROOM;
+        header->endRoom = cursor->base + exits[0];
+    } else {
+        /* placeholders until the next shard picks the rooms they lead to */
+        exitCount = pickLinkRooms(shard, exits, 1, SHARD_LINKS, SHARD_FRONTIER);
+        for (i = 0; i < exitCount; ++i) {
+            getConnections(shard, shard->list[exits[i]])[shard->list[exits[i]]->connectCount++] = -1;
+        }
+    }
+    chargePhase(&cursor->stats, PLACE_PHASE, &started, &allocated);
+    compactGraph(shard);
+    chargePhase(&cursor->stats, COMPACT_PHASE, &started, &allocated);
+    /* each placeholder is the last connection of its room */
+    for (i = 0; i < exitCount; ++i) {
+        cursor->exitRooms[i] = cursor->base + exits[i];
+        cursor->exitSlots[i] = header->edgeOffset
+                             + ((uint64_t)cursor->edgeCount + shard->rowStart[exits[i] + 1] - 1) * sizeof(int32_t);
+    }
+    cursor->exitCount = exitCount;
+    flag = writeShard(fd, shard, header, cursor);
+    chargePhase(&cursor->stats, WRITE_PHASE, &started, &allocated);
+    endShard(shard, cursor);
+    return flag;
+}
+
+
+/*
+Picks rooms of a shard with a free connection slot for links to another
+shard, scanning at most limit rooms from a random one, until picked holds
+want rooms.  The count rooms already in picked are not picked again.
+Returns the number of rooms in picked.
+*/
+int pickLinkRooms(struct world *shard, int *picked, int count, int want, int limit) {
+    int start = randomBelow(&shard->rng, shard->roomCount);
+    int i, j;
+    int id;
+
+    if (limit > shard->roomCount) {
+        limit = shard->roomCount;
+    }
+    for (i = 0; i < limit && count < want; ++i) {
+        id = (start + i) % shard->roomCount;
+        if (canAddConnectionFrom(shard, shard->list[id])) {
+            for (j = 0; j < count && picked[j] != id; ++j) {
+            }
+            if (j == count) {
+                picked[count++] = id;
+            }
+        }
+    }
+    return count;
+}
+
+
+/*
+Adds the retried draws of a shard to the map's counters and frees the shard.
+*/
+void endShard(struct world *shard, struct shardCursor *cursor) {
+    cursor->stats.nameRetries += shard->stats.nameRetries;
+    cursor->stats.pickRetries += shard->stats.pickRetries;
+    cursor->stats.rewires += shard->stats.rewires;
+    cursor->stats.placeRetries += shard->stats.placeRetries;
+    destroyWorld(shard);
+}
+
+
+/*
+Writes the types, names, rows, strings and edges of one shard in place in
+the map file, with one write per section.  Connections inside the shard are
+turned into world room ids; negative ids already are (-id - 1) world ids.
+Returns 1 if the shard is written, otherwise returns 0.
+*/
+int writeShard(int fd, struct world *shard, struct mapHeader *header, struct shardCursor *cursor) {
+    unsigned char *types = NULL;
+    uint32_t *names = NULL;
+    uint32_t *rows = NULL;
+    int32_t *edges = NULL;
+    char *strings = NULL;
+    uint32_t stringSize = 0;
+    uint32_t edgeCount = shard->rowStart[shard->roomCount];
+    uint64_t base = cursor->base;
+    int i;
+    uint32_t j;
+    int flag;
+
+    types = (unsigned char *)malloc(shard->roomCount);
+    assert(types != 0);
+    countAllocation();
+    names = (uint32_t *)malloc(shard->roomCount * sizeof(uint32_t));
+    assert(names != 0);
+    countAllocation();
+    rows = (uint32_t *)malloc(shard->roomCount * sizeof(uint32_t));
+    assert(rows != 0);
+    countAllocation();
+    edges = (int32_t *)malloc(edgeCount * sizeof(int32_t) + 1);
+    assert(edges != 0);
+    countAllocation();
+    for (i = 0; i < shard->roomCount; ++i) {
+        types[i] = shard->list[i]->roomType;
+        names[i] = cursor->stringSize + stringSize;
+        stringSize += strlen(shard->list[i]->name) + 1;
+        rows[i] = cursor->edgeCount + shard->rowStart[i];
+    }
+    strings = (char *)malloc(stringSize);
+    assert(strings != 0);
+    countAllocation();
+    for (i = 0; i < shard->roomCount; ++i) {
+        strcpy(strings + names[i] - cursor->stringSize, shard->list[i]->name);
+    }
+    for (j = 0; j < edgeCount; ++j) {
+        edges[j] = shard->adjacent[j] >= 0 ? (int32_t)(base + shard->adjacent[j]) : -shard->adjacent[j] - 1;
+    }
+    flag = writeAt(fd, types, shard->roomCount, header->typeOffset + base)
+        && writeAt(fd, names, shard->roomCount * sizeof(uint32_t), header->nameOffset + base * sizeof(uint32_t))
+        && writeAt(fd, rows, shard->roomCount * sizeof(uint32_t), header->rowOffset + base * sizeof(uint32_t))
+        && writeAt(fd, strings, stringSize, header->stringOffset + cursor->stringSize)
+        && writeAt(fd, edges, edgeCount * sizeof(int32_t), header->edgeOffset + (uint64_t)cursor->edgeCount * sizeof(int32_t));
+    cursor->stringSize += stringSize;
+    cursor->edgeCount += edgeCount;
+    free(types);
+    free(names);
+    free(rows);
+    free(edges);
+    free(strings);
+    return flag;
+}
+
+
+/*
+Shuffles the words of the name pool a sharded map can use: those that do not
+end in a digit, so a word plus a number never reads as another word plus a
+number and every name is unique without remembering the names used.
+Returns the number of words in order (the caller frees order).
+*/
+int shardWords(struct world *aWorld, struct namePool *pool, char ***order) {
+    char **words = NULL;
+    char *swap = NULL;
+    size_t length;
+    int count = 0;
+    int i, j;
+
+    words = (char **)malloc(pool->count * sizeof(char *));
+    assert(words != 0);
+    for (i = 0; i < pool->count; ++i) {
+        length = strlen(pool->words[i]);
+        if (isdigit((unsigned char)pool->words[i][length - 1]) == 0) {
+            words[count++] = pool->words[i];
+        }
+    }
+    for (i = 0; i + 1 < count; ++i) {
+        j = i + randomBelow(&aWorld->rng, count - i);
+        swap = words[i];
+        words[i] = words[j];
+        words[j] = swap;
+    }
+    *order = words;
+    return count;
+}
+
+
+/*
+Names the rooms of a shard.  World room id is word id % wordCount of the
+shuffled words, followed by id / wordCount unless that is 0.
+*/
+void nameShard(struct world *shard, char **order, int wordCount, int base) {
+    char numbered[STR];
+    int i;
+    int id;
+    struct room **list = shard->list;
+
+    for (i = 0; i < shard->roomCount; ++i) {
+        id = base + i;
+        if (id < wordCount) {
+            snprintf(numbered, STR, "%s", order[id]);
+        } else {
+            snprintf(numbered, STR, "%s%d", order[id % wordCount], id / wordCount);
+        }
+        list[i]->name = arenaString(&shard->memory, numbered);
+        list[i]->id = i;
+        list[i]->connectCount = 0;
+        list[i]->roomType = MID_ROOM;
+    }
+}
+
+
+/*
+Returns the size of the string table of a sharded map, NUL bytes included,
+without naming the rooms: word j names the rooms j, j + wordCount, ... and
+all but the first of them carry the numbers 1, 2, ...
+*/
+uint64_t shardStringSize(char **order, int wordCount, int roomCount) {
+    uint64_t total = 0;
+    uint64_t uses;
+    int j;
+
+    for (j = 0; j < wordCount && j < roomCount; ++j) {
+        uses = (uint64_t)(roomCount - 1 - j) / wordCount + 1;
+        total += uses * (strlen(order[j]) + 1) + digitTotal(uses - 1);
+    }
+    return total;
+}
+
+
+/*
+Returns the number of digits needed to write every number from 1 to last.
+*/
+uint64_t digitTotal(uint64_t last) {
+    uint64_t total = 0;
+    uint64_t low = 1;
+    uint64_t high;
+    int digits = 1;
+
+    while (low <= last) {
+        high = low * 10 - 1 < last ? low * 10 - 1 : last;
+        total += (high - low + 1) * digits;
+        low *= 10;
+        ++digits;
+    }
+    return total;
+}
+
+
+/*
+Runs the generator over a sweep of world sizes and prints one record per map.
+Room counts go 10, 100, 1000, ... up to roomCount, and for each the maximum
+number of connections goes from minDegree + 1 up to maxDegree (sizes the
+bounds do not fit are skipped).  Every size builds mapCount maps, one after
+the other so the timings do not compete for the processor.  A map that cannot
+be built is left out of the report and the sweep goes on.
+Returns 1 if every map is built, otherwise returns 0.
+*/
+int runBenchmark(struct world *template, struct namePool *pool, struct settings *options, int pid) {
+    struct world cell = *template;
+    struct counters stats;
+    int rooms = 10 < template->roomCount ? 10 : template->roomCount;
+    int degree;
+    int mapIndex;
+    int records = 0;
+    int failed = 0;
+
+    if (options->report == JSON_REPORT) {
+        printf("[\n");
+    }
+    while (1) {
+        cell.roomCount = rooms;
+        degree = template->minDegree < template->maxDegree ? template->minDegree + 1 : template->maxDegree;
+        for (; degree <= template->maxDegree && degree < rooms; ++degree) {
+            cell.maxDegree = degree;
+            for (mapIndex = 0; mapIndex < options->mapCount; ++mapIndex) {
+                if (buildMap(&cell, pool, options, pid, mapIndex, &stats) == 0) {
+                    ++failed;
+                    continue;
+                }
+                printRecord(&cell, options, &stats, mapIndex, records++ == 0);
+            }
+        }
+        if (rooms == template->roomCount) {
+            break;
+        }
+        rooms = rooms <= template->roomCount / 10 ? rooms * 10 : template->roomCount;
+    }
+    if (options->report == JSON_REPORT) {
+        printf("\n]\n");
+    }
+    fflush(stdout);
+    if (failed) {
+        fprintf(stderr, "%d of %d benchmark maps could not be built\n", failed, failed + records);
+    }
+    return failed == 0;
+}
+
+
+/*
+Prints the counters of one benchmark map as a JSON object or a CSV row.  The
+first record of a CSV report is preceded by the column names.
+*/
+void printRecord(struct world *cell, struct settings *options, struct counters *stats, int mapIndex, int first) {
+    char *generator = cell->generator == CONSTRUCTIVE ? "constructive" : "classic";
+    double total = 0;
+    int i;
+
+    for (i = 0; i < PHASES; ++i) {
+        total += stats->phaseTime[i];
+    }
+    if (options->report == CSV_REPORT) {
+        if (first) {
+            printf("generator,rooms,min_degree,max_degree,seed,map");
+            for (i = 0; i < PHASES; ++i) {
+                printf(",%s_ms,%s_allocations", phaseNames[i], phaseNames[i]);
+            }
+            printf(",total_ms,name_retries,pick_retries,rewires,place_retries,arena_chunks\n");
+        }
+        printf("%s,%d,%d,%d,%llu,%d", generator, cell->roomCount, cell->minDegree, cell->maxDegree,
+               (unsigned long long)options->seed, mapIndex);
+        for (i = 0; i < PHASES; ++i) {
+            printf(",%.3f,%ld", stats->phaseTime[i], stats->phaseAllocations[i]);
+        }
+        printf(",%.3f,%ld,%ld,%ld,%ld,%d\n", total, stats->nameRetries, stats->pickRetries,
+               stats->rewires, stats->placeRetries, stats->arenaChunks);
+        return;
+    }
+    printf("%s  {\"generator\": \"%s\", \"rooms\": %d, \"min_degree\": %d, \"max_degree\": %d,"
+           " \"seed\": %llu, \"map\": %d", first ? "" : ",\n", generator, cell->roomCount,
+           cell->minDegree, cell->maxDegree, (unsigned long long)options->seed, mapIndex);
+    for (i = 0; i < PHASES; ++i) {
+        printf(", \"%s_ms\": %.3f, \"%s_allocations\": %ld", phaseNames[i], stats->phaseTime[i],
+               phaseNames[i], stats->phaseAllocations[i]);
+    }
+    printf(", \"total_ms\": %.3f, \"name_retries\": %ld, \"pick_retries\": %ld, \"rewires\": %ld,"
+           " \"place_retries\": %ld, \"arena_chunks\": %d}", total, stats->nameRetries,
+           stats->pickRetries, stats->rewires, stats->placeRetries, stats->arenaChunks);
+}
+
+
+/*
+Charges the time and the allocations since the end of the previous phase to
+a phase, then starts the next one.
+*/
+void endPhase(struct world *aWorld, int phase, double *started, long *allocated) {
+    recordLatency(&buildMetrics.phaseSeconds[phase], chargePhase(&aWorld->stats, phase, started, allocated));
+}
+
+
+/*
+Adds the time and the allocations since the end of the previous phase to a
+phase's counters, then starts the next one.  A sharded map charges each phase
+once per shard.
+Returns the seconds charged.
+*/
+double chargePhase(struct counters *stats, int phase, double *started, long *allocated) {
+    double now = readClock();
+    double seconds = now - *started;
+    long count = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+
+    stats->phaseTime[phase] += seconds * 1000.0;
+    stats->phaseAllocations[phase] += count - *allocated;
+    *started = now;
+    *allocated = count;
+    return seconds;
+}
+
+
+/*
+Returns the time of a clock that only moves forward, in seconds.
+*/
+double readClock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+Counts one heap allocation of the generator.  Workers of a batch share the
+count, so only a benchmark (one map at a time) can charge it to a map.
+*/
+void countAllocation(void) {
+    __atomic_add_fetch(&allocationCount, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+Starts keeping metrics for export to a file.  SIGUSR1 is blocked here, in
+the main thread, so the workers started later block it too and only the
+metrics thread, waiting for it, takes the signal.
+*/
+void startMetrics(char *path) {
+    sigset_t signals;
+    int resultCode;
+
+    buildMetrics.path = path;
+    buildMetrics.stop = 0;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    resultCode = pthread_create(&buildMetrics.thread, NULL, runMetrics, NULL);
+    assert(0 == resultCode);
+}
+
+
+/*
+Has the metrics thread write the metrics one last time, and waits for it.
+Does nothing if no metrics are kept.
+*/
+void stopMetrics(void) {
+    int resultCode;
+
+    if (!buildMetrics.path) {
+        return;
+    }
+    __atomic_store_n(&buildMetrics.stop, 1, __ATOMIC_RELEASE);
+    pthread_kill(buildMetrics.thread, SIGUSR1);
+    resultCode = pthread_join(buildMetrics.thread, NULL);
+    assert(0 == resultCode);
+}
+
+
+/*
+Thread body of the metrics: writes the metrics file each time SIGUSR1
+arrives, until stopMetrics asks for the last one.
+*/
+void *runMetrics(void *argument) {
+    sigset_t signals;
+    int signalNumber;
+
+    (void)argument;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    do {
+        sigwait(&signals, &signalNumber);
+        writeMetrics();
+    } while (!__atomic_load_n(&buildMetrics.stop, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+
+/*
+Adds one observation of a phase's time to a latency histogram.
+*/
+void recordLatency(struct histogram *latency, double seconds) {
+    int i = 0;
+
+    if (!buildMetrics.path) {
+        return;
+    }
+    while (i < LATENCY_BUCKETS - 1 && seconds > latencyBounds[i]) {
+        ++i;
+    }
+    __atomic_add_fetch(&latency->counts[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->sumNanos, (unsigned long long)(seconds * 1e9), __ATOMIC_RELAXED);
+}
+
+
+/*
+Counts a map in the metrics: a built one with its rooms, connections and,
+when stats is not NULL, its retried draws; otherwise a failed one.
+*/
+void recordMap(struct counters *stats, int roomCount, long edgeCount, int built) {
+    if (!built) {
+        addMetric(&buildMetrics.failedMaps, 1);
+        return;
+    }
+    addMetric(&buildMetrics.maps, 1);
+    addMetric(&buildMetrics.rooms, roomCount);
+    addMetric(&buildMetrics.edges, edgeCount);
+    if (stats) {
+        addMetric(&buildMetrics.nameRetries, stats->nameRetries);
+        addMetric(&buildMetrics.pickRetries, stats->pickRetries);
+        addMetric(&buildMetrics.rewires, stats->rewires);
+        addMetric(&buildMetrics.placeRetries, stats->placeRetries);
+    }
+}
+
+
+/*
+Adds an amount to a counter of the metrics.
+*/
+void addMetric(unsigned long *counter, unsigned long amount) {
+    if (buildMetrics.path) {
+        __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+Writes the metrics in the Prometheus text format to a temporary file, then
+renames it over the metrics file.  The phase histograms share one name, with
+the phase as a label.
+*/
+void writeMetrics(void) {
+    char fileName[STR];
+    char *name = "lindorg_buildrooms_phase_seconds";
+    unsigned long total;
+    FILE *stream;
+    int phase, i;
+
+    if (snprintf(fileName, STR, "%s.tmp", buildMetrics.path) >= STR) {
+        fprintf(stderr, "Metrics file name %s is too long\n", buildMetrics.path);
+        return;
+    }
+    stream = fopen(fileName, "w");
+    if (!stream) {
+        fprintf(stderr, "Unable to write the metrics to %s\n", fileName);
+        return;
+    }
+    fprintf(stream, "# HELP %s Time of each phase of building a map.\n# TYPE %s histogram\n", name, name);
+    for (phase = 0; phase < PHASES; ++phase) {
+        total = 0;
+        for (i = 0; i < LATENCY_BUCKETS; ++i) {
+            total += __atomic_load_n(&buildMetrics.phaseSeconds[phase].counts[i], __ATOMIC_RELAXED);
+            if (i < LATENCY_BUCKETS - 1) {
+                fprintf(stream, "%s_bucket{phase=\"%s\",le=\"%g\"} %lu\n", name, phaseNames[phase],
+                        latencyBounds[i], total);
+            } else {
+                fprintf(stream, "%s_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", name, phaseNames[phase], total);
+            }
+        }
+        fprintf(stream, "%s_sum{phase=\"%s\"} %.9f\n%s_count{phase=\"%s\"} %lu\n", name, phaseNames[phase],
+                __atomic_load_n(&buildMetrics.phaseSeconds[phase].sumNanos, __ATOMIC_RELAXED) / 1e9,
+                name, phaseNames[phase], total);
+    }
+    writeCounter(stream, "lindorg_buildrooms_maps_total", "counter", "Maps built.",
+                 __atomic_load_n(&buildMetrics.maps, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_failed_maps_total", "counter", "Maps that could not be built.",
+                 __atomic_load_n(&buildMetrics.failedMaps, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_rooms_total", "counter", "Rooms of the maps built.",
+                 __atomic_load_n(&buildMetrics.rooms, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_edges_total", "counter", "Connections of the maps built.",
+                 __atomic_load_n(&buildMetrics.edges, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_name_retries_total", "counter", "Room names drawn again.",
+                 __atomic_load_n(&buildMetrics.nameRetries, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_pick_retries_total", "counter", "Room pairs drawn again.",
+                 __atomic_load_n(&buildMetrics.pickRetries, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_rewires_total", "counter", "Connections moved to free a slot.",
+                 __atomic_load_n(&buildMetrics.rewires, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_place_retries_total", "counter", "Start rooms tried again.",
+                 __atomic_load_n(&buildMetrics.placeRetries, __ATOMIC_RELAXED));
+    writeCounter(stream, "lindorg_buildrooms_allocations_total", "counter", "Heap allocations of the generator.",
+                 (unsigned long)__atomic_load_n(&allocationCount, __ATOMIC_RELAXED));
+    if (fclose(stream) != 0 || rename(fileName, buildMetrics.path) == -1) {
+        fprintf(stderr, "Unable to write the metrics to %s\n", buildMetrics.path);
+        unlink(fileName);
+    }
+}
+
+
+/*
+Writes one counter or gauge with its help and type lines.
+*/
+void writeCounter(FILE *stream, char *name, char *type, char *help, unsigned long value) {
+    fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+
+/*
+Seeds a generator for one stream of a seed.  Streams are spread apart by
+running the seed and the stream number through the splitmix64 finalizer.
+*/
+void seedRandom(struct prng *rng, uint64_t seed, uint64_t stream) {
+    rng->state = seed;
+    rng->state = nextRandom(rng) ^ (stream * 0xd1b54a32d192ed03ULL);
+    rng->state = nextRandom(rng);
+}
+
+
+/*
+Returns the next 64 random bits of a splitmix64 generator.
+*/
+uint64_t nextRandom(struct prng *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/*
+Returns a random value from 0 to bound - 1 by scaling 32 random bits, which
+avoids the division of rand() % bound.
+*/
+int randomBelow(struct prng *rng, int bound) {
+    return (int)(((nextRandom(rng) >> 32) * (uint64_t)bound) >> 32);
+}
+
+
+/*
+Reads the command line options into the world settings.  Defaults are the
+classic game: seven rooms with 3 to 6 connections each.
+Returns 1 if the options describe a valid world, otherwise returns 0.
+*/
+int parseOptions(int argc, char *argv[], struct world *aWorld, struct settings *options) {
+    int option;
+    struct timespec now;
+
+    options->dictionary = NULL;
+    options->binary = 0;
+    options->sync = 0;
+    options->report = NO_REPORT;
+    options->shardSize = 0;
+    options->metricsPath = NULL;
+    options->mapCount = 1;
+    options->threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    /* different every run, even for runs started in the same second */
+    clock_gettime(CLOCK_REALTIME, &now);
+    options->seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 40);
+    aWorld->roomCount = SELECTED;
+    aWorld->minDegree = MIN;
+    aWorld->maxDegree = CONN_SZ;
+    aWorld->generator = CLASSIC;
+    aWorld->minDistance = 1;
+    aWorld->list = NULL;
+    aWorld->adjacent = NULL;
+    aWorld->rowStart = NULL;
+    while ((option = getopt(argc, argv, "n:m:x:g:d:bs:N:t:fD:B:S:M:")) != -1) {
+        switch (option) {
+            case 'n':
+                aWorld->roomCount = atoi(optarg);
+                break;
+            case 'm':
+                aWorld->minDegree = atoi(optarg);
+                break;
+            case 'x':
+                aWorld->maxDegree = atoi(optarg);
+                break;
+            case 'g':
+                if (strcmp(optarg, "constructive") == 0) {
+                    aWorld->generator = CONSTRUCTIVE;
+                } else if (strcmp(optarg, "classic") == 0) {
+                    aWorld->generator = CLASSIC;
+                } else {
+                    return 0;
+                }
+                break;
+            case 'd':
+                options->dictionary = optarg;
+                break;
+            case 'b':
+                options->binary = 1;
+                break;
+            case 's':
+                options->seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'N':
+                options->mapCount = atoi(optarg);
+                break;
+            case 't':
+                options->threadCount = atoi(optarg);
+                break;
+            case 'f':
+                options->sync = 1;
+                break;
+            case 'D':
+                aWorld->minDistance = atoi(optarg);
+                break;
+            case 'B':
+                if (strcmp(optarg, "json") == 0) {
+                    options->report = JSON_REPORT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    options->report = CSV_REPORT;
+                } else {
+                    return 0;
+                }
+                break;
+            case 'S':
+                options->shardSize = atoi(optarg);
+                break;
+            case 'M':
+                options->metricsPath = optarg;
+                break;
+            default:
+                return 0;
+        }
+    }
+    /* a room cannot connect to itself, so degrees are bounded by the other rooms */
+    if (aWorld->roomCount < 2 || aWorld->minDegree < 1
+        || aWorld->maxDegree < aWorld->minDegree
+        || aWorld->maxDegree > aWorld->roomCount - 1) {
+        return 0;
+    }
+    if (options->mapCount < 1 || options->threadCount < 1 || aWorld->minDistance < 1) {
+        return 0;
+    }
+    /* every shard must hold a full set of connections, and shards only go to binary maps */
+    if (options->shardSize != 0 && (options->shardSize < 2 * (aWorld->maxDegree + 1)
+                                    || options->binary == 0 || options->report != NO_REPORT)) {
+        return 0;
+    }
+    /* no point in idle workers */
+    if (options->threadCount > options->mapCount) {
+        options->threadCount = options->mapCount;
+    }
+    return 1;
+}
+
+
+/*
+ Randomly selects the start and end room of the selected rooms.
+ The start room is drawn from the largest group of connected rooms; a breadth
+ first search from it then draws the end room among the rooms at least
+ minDistance moves away.  A few start rooms are tried before giving up.
+ Returns 1 if both rooms are placed, otherwise returns 0.
+*/
+int createStartAndEnd(struct world *aWorld) {
+    struct room **list = aWorld->list;
+    int head = -1, tail = -1;
+    int tries;
+    int *distance = NULL;
+    int *queue = NULL;
+
+    distance = (int *)malloc(aWorld->roomCount * sizeof(int));
+    assert(distance != 0);
+    countAllocation();
+    queue = (int *)malloc(aWorld->roomCount * sizeof(int));
+    assert(queue != 0);
+    countAllocation();
+    /* create random values for start and end */
+    for (tries = 0; tries < PICK_TRIES && tail == -1; ++tries) {
+        head = pickRoomInLargestGroup(aWorld, 0);
+        tail = placeEnd(aWorld, head, aWorld->minDistance, 0, distance, queue);
+    }
+    aWorld->stats.placeRetries += tries - 1;
+    free(distance);
+    free(queue);
+    if (tail == -1) {
+        return 0;
+    }
+    aWorld->startRoom = head;
+    aWorld->endRoom = tail;
+    list[head]->roomType = START_ROOM;
+    list[tail]->roomType = END_ROOM;
+    return 1;
+}
+
+
+/*
+ Runs a breadth first search from the start room and picks one of the rooms
+ at least minDistance moves away, each with the same chance (reservoir
+ sampling), so the search is the only pass over the graph.  With needSlot
+ only rooms with a free connection slot are picked.  Negative ids are
+ connections into other shards and are not followed.
+ Returns the end room, or -1 if no room is far enough from the start.
+*/
+int placeEnd(struct world *aWorld, int head, int minDistance, int needSlot, int *distance, int *queue) {
+    int front = 0, back = 0;
+    int current, next, j;
+    int candidates = 0;
+    int tail = -1;
+    int *connections;
+
+    for (j = 0; j < aWorld->roomCount; ++j) {
+        distance[j] = -1;
+    }
+    distance[head] = 0;
+    queue[back++] = head;
+    while (front < back) {
+        current = queue[front++];
+        if (distance[current] >= minDistance
+            && (needSlot == 0 || canAddConnectionFrom(aWorld, aWorld->list[current]))) {
+            ++candidates;
+            if (randomBelow(&aWorld->rng, candidates) == 0) {
+                tail = current;
+            }
+        }
+        connections = getConnections(aWorld, aWorld->list[current]);
+        for (j = 0; j < aWorld->list[current]->connectCount; ++j) {
+            next = connections[j];
+            if (next >= 0 && distance[next] == -1) {
+                distance[next] = distance[current] + 1;
+                queue[back++] = next;
+            }
+        }
+    }
+    return tail;
+}
+
+
+/*
+ Returns a random room of the largest group of connected rooms, with a free
+ connection slot if needSlot is set.  The largest group nearly always holds
+ most rooms, so a few draws find one; otherwise the rooms are scanned from a
+ random point.
+ Returns -1 if no room of the group qualifies.
+*/
+int pickRoomInLargestGroup(struct world *aWorld, int needSlot) {
+    int i;
+    int id;
+    int root = findGroup(aWorld, aWorld->largestGroup);
+
+    for (i = 0; i < PICK_TRIES; ++i) {
+        id = randomBelow(&aWorld->rng, aWorld->roomCount);
+        if (findGroup(aWorld, id) == root
+            && (needSlot == 0 || canAddConnectionFrom(aWorld, aWorld->list[id]))) {
+            return id;
+        }
+    }
+    id = randomBelow(&aWorld->rng, aWorld->roomCount);
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        if (findGroup(aWorld, (id + i) % aWorld->roomCount) == root
+            && (needSlot == 0 || canAddConnectionFrom(aWorld, aWorld->list[(id + i) % aWorld->roomCount]))) {
+            return (id + i) % aWorld->roomCount;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ Returns the representative room of the group a room belongs to, halving the
+ path to it on the way.
+*/
+int findGroup(struct world *aWorld, int id) {
+    int *parent = aWorld->parent;
+
+    while (parent[id] != id) {
+        parent[id] = parent[parent[id]];
+        id = parent[id];
+    }
+    return id;
+}
+
+
+/*
+ Merges the groups of two connected rooms, the smaller group joins the larger,
+ and keeps track of the largest group and the number of groups.
+*/
+void joinGroups(struct world *aWorld, int idX, int idY) {
+    int rootX = findGroup(aWorld, idX);
+    int rootY = findGroup(aWorld, idY);
+    int swap;
+
+    if (rootX == rootY) {
+        return;
+    }
+    if (aWorld->groupSize[rootX] < aWorld->groupSize[rootY]) {
+        swap = rootX;
+        rootX = rootY;
+        rootY = swap;
+    }
+    aWorld->parent[rootY] = rootX;
+    aWorld->groupSize[rootX] += aWorld->groupSize[rootY];
+    --aWorld->groupCount;
+    if (aWorld->groupSize[rootX] > aWorld->groupSize[findGroup(aWorld, aWorld->largestGroup)]) {
+        aWorld->largestGroup = rootX;
+    }
+}
+
+
+/*
+Allocates the room list and the connection slots of a world.  The arena is
+sized up front for the rooms, the connections and typical names, so most
+worlds fit in its first chunk.
+*/
+void makeWorld(struct world *aWorld) {
+    size_t slots = (size_t)aWorld->roomCount * aWorld->maxDegree;
+    size_t rooms = aWorld->roomCount;
+    int i;
+
+    makeArena(&aWorld->memory, rooms * (sizeof(struct room) + sizeof(struct room *) + 16)
+                             + (slots + 3 * rooms + 1) * sizeof(int) + 64);
+    aWorld->list = makeRoomList(&aWorld->memory, aWorld->roomCount);
+    aWorld->adjacent = (int *)arenaAlloc(&aWorld->memory, slots * sizeof(int));
+    aWorld->rowStart = NULL;
+    aWorld->edges.kind = EDGE_SCAN;
+    aWorld->edges.words = NULL;
+    /* every room starts as a group of its own */
+    aWorld->parent = (int *)arenaAlloc(&aWorld->memory, rooms * sizeof(int));
+    aWorld->groupSize = (int *)arenaAlloc(&aWorld->memory, rooms * sizeof(int));
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        aWorld->parent[i] = i;
+        aWorld->groupSize[i] = 1;
+    }
+    aWorld->groupCount = aWorld->roomCount;
+    aWorld->largestGroup = 0;
+    memset(&aWorld->stats, 0, sizeof(aWorld->stats));
+}
+
+
+/*
+Deallocates the rooms and the connection store of a world.
+*/
+void destroyWorld(struct world *aWorld) {
+    destroyArena(&aWorld->memory);
+    aWorld->list = NULL;
+    aWorld->adjacent = NULL;
+    aWorld->rowStart = NULL;
+}
+
+
+/* Create a list of room struct pointers, the rooms are one block in the arena */
+struct room **makeRoomList(struct arena *memory, int roomCount) {
+    int index;
+    struct room *block = (struct room *)arenaAlloc(memory, roomCount * sizeof(struct room));
+    struct room **list = (struct room **)arenaAlloc(memory, roomCount * sizeof(struct room*));
+
+    for (index = 0; index < roomCount; ++index) {
+        list[index] = &block[index];
+    }
+    return list;
+}
+
+
+/*
+Creates an arena whose first chunk holds at least size bytes.
+*/
+void makeArena(struct arena *memory, size_t size) {
+    memory->chunks = NULL;
+    memory->next = NULL;
+    memory->left = 0;
+    memory->chunkCount = 0;
+    addArenaChunk(memory, size);
+}
+
+
+/*
+Starts a new chunk of at least size bytes (ARENA_CHUNK at the least); what
+was left of the previous chunk is not used again.
+*/
+void addArenaChunk(struct arena *memory, size_t size) {
+    struct arenaChunk *chunk = NULL;
+    size_t chunkSize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+
+    chunk = (struct arenaChunk *)malloc(sizeof(struct arenaChunk) + chunkSize);
+    assert(chunk != 0);
+    countAllocation();
+    chunk->previous = memory->chunks;
+    chunk->size = chunkSize;
+    memory->chunks = chunk;
+    memory->next = (char *)(chunk + 1);
+    memory->left = chunkSize;
+    ++memory->chunkCount;
+}
+
+
+/*
+Carves size bytes, rounded up to a multiple of 8, from the arena.  When the
+current chunk is full a new chunk is added.
+*/
+void *arenaAlloc(struct arena *memory, size_t size) {
+    void *result;
+
+    size = (size + 7) & ~(size_t)7;
+    if (size > memory->left) {
+        addArenaChunk(memory, size);
+    }
+    result = memory->next;
+    memory->next += size;
+    memory->left -= size;
+    return result;
+}
+
+
+/*
+Copies a string into the arena.
+*/
+char *arenaString(struct arena *memory, char *data) {
+    size_t size = strlen(data) + 1;
+    char *newStr = (char *)arenaAlloc(memory, size);
+
+    memcpy(newStr, data, size);
+    return newStr;
+}
+
+
+/*
+Releases every chunk of an arena at once.
+*/
+void destroyArena(struct arena *memory) {
+    struct arenaChunk *chunk = memory->chunks;
+    struct arenaChunk *previous;
+
+    while (chunk) {
+        previous = chunk->previous;
+        free(chunk);
+        chunk = previous;
+    }
+    memory->chunks = NULL;
+    memory->next = NULL;
+    memory->left = 0;
+    memory->chunkCount = 0;
+}
+
+
+/*
+Creates a directory.  Maps of a batch add their map index after the pid.
+Returns 0 is the directy is created, otherwise returns -1.
+*/
+int makeDir(char * directoryName, int pid, int mapIndex) {
+    int flag = 0;
+    char pidStr[24];
+
+    memset(pidStr, '\0', 24);
+
+    /* change pid to to string */
+    if (mapIndex < 0) {
+        flag = snprintf(pidStr, 24, "%d", pid);
+    } else {
+        flag = snprintf(pidStr, 24, "%d.%d", pid, mapIndex);
+    }
+    /* concatenate pid string to directory name */
+    if (flag > 0) {
+        strcat(directoryName, pidStr);
+        /* create the directory */
+        flag = mkdir(directoryName, 0755);
+     } else {
+         flag = -1;
+     }
+    return flag;
+}
+
+
+/*
+Publishes a complete map by renaming its staging directory to the matching
+lindorg.rooms. name; rename is atomic, so a reader sees all of the map or none
+of it.  With sync, the files are already on disk and the directories are
+flushed around the rename; failing to flush after the rename is only a warning.
+Returns 1 if the map is published, otherwise returns 0.
+*/
+int publishDir(char *stagingName, int sync) {
+    char directoryName[STR];
+
+    snprintf(directoryName, STR, "%s%s", ROOMS_PREFIX, stagingName + strlen(STAGING_PREFIX));
+    if (sync && syncPath(stagingName) == 0) {
+        return 0;
+    }
+    if (rename(stagingName, directoryName) == -1) {
+        return 0;
+    }
+    /* a stale pointer only costs readers a scan, so the map stays published */
+    if (pointLatest(directoryName) == 0) {
+        fprintf(stderr, "Unable to point %s at %s\n", LATEST_LINK, directoryName);
+    }
+    /* the rename has happened, so the staging directory is gone; a failed flush
+       only means the new name may not survive a crash */
+    if (sync && syncPath(".") == 0) {
+        fprintf(stderr, "Warning: unable to flush the directory holding %s\n", directoryName);
+    }
+    return 1;
+}
+
+
+/*
+Points the lindorg.rooms.latest link at a published map.  The new link is
+made under a name of its own and renamed over the old one, so readers always
+find a link to a complete map, never a missing or half written one.
+Returns 1 if the link is updated, otherwise returns 0.
+*/
+int pointLatest(char *directoryName) {
+    char linkName[STR];
+
+    snprintf(linkName, STR, "%slatest.%s", STAGING_PREFIX, directoryName + strlen(ROOMS_PREFIX));
+    unlink(linkName);
+    if (symlink(directoryName, linkName) == -1) {
+        return 0;
+    }
+    if (rename(linkName, LATEST_LINK) == -1) {
+        unlink(linkName);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+Removes a staging directory and the files written to it so far.
+*/
+void removeStaging(char *stagingName) {
+    DIR *dirToCheck;
+    struct dirent *fileInDir;
+    char fileName[STR + sizeof(fileInDir->d_name)];
+
+    dirToCheck = opendir(stagingName);
+    if (dirToCheck) {
+        while ((fileInDir = readdir(dirToCheck)) != NULL) {
+            if (strcmp(fileInDir->d_name, ".") && strcmp(fileInDir->d_name, "..")) {
+                snprintf(fileName, sizeof(fileName), "%s/%s", stagingName, fileInDir->d_name);
+                unlink(fileName);
+            }
+        }
+        closedir(dirToCheck);
+    }
+    rmdir(stagingName);
+}
+
+
+/*
+Flushes a file or directory to disk.
+Returns 1 on success, otherwise returns 0.
+*/
+int syncPath(char *path) {
+    int fd = open(path, O_RDONLY);
+    int flag = 1;
+
+    if (fd == -1) {
+        return 0;
+    }
+    if (fsync(fd) == -1) {
+        flag = 0;
+    }
+    close(fd);
+    return flag;
+}
+
+
+/*
+writes one file per room to a specific directory
+All rooms are first formatted into one memory buffer, then every file gets
+its slice of the buffer in a single write (and an fsync when sync is set).
+Returns 1 if file is created, otherwise returns 0.
+*/
+int writeFile(char *directoryName, struct world *aWorld, int sync) {
+    int flag = 1;
+    char fileName[STR];
+    int i;
+    int fd;
+    FILE *stage;
+    char *text = NULL;
+    size_t textSize = 0;
+    size_t *offsets = NULL;
+
+    /* stage the contents of every room */
+    offsets = (size_t *)malloc((aWorld->roomCount + 1) * sizeof(size_t));
+    assert(offsets != 0);
+    countAllocation();
+    stage = open_memstream(&text, &textSize);
+    assert(stage != 0);
+    countAllocation();
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        offsets[i] = ftell(stage);
+        writeOneRoom(stage, aWorld, aWorld->list[i]);
+    }
+    fclose(stage);
+    offsets[aWorld->roomCount] = textSize;
+    memset(fileName, '\0', STR);
+    /* for each room */
+    for ( i = 0; i < aWorld->roomCount && flag; ++i) {
+        /* create the file name */
+        createFileName(fileName, directoryName, aWorld->list[i]);
+        /* open a file */
+        fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            flag = 0;
+            break;
+        }
+        /* write room contents to a file */
+        flag = writeAll(fd, text + offsets[i], offsets[i + 1] - offsets[i]);
+        if (flag && sync && fsync(fd) == -1) {
+            flag = 0;
+        }
+        /* close file */
+        if (close(fd) == -1) {
+            flag = 0;
+        }
+        memset(fileName, '\0', STR);
+    }
+    free(text);
+    free(offsets);
+    return flag;
+}
+
+
+/*
+Writes the whole world to a single binary map file, dirName/rooms.map.
+The CSR arrays are written as they are; only the room types, the name offsets
+and the string table are staged first, so the file costs a handful of large
+writes.  With sync the file is flushed to disk before it is closed.
+Returns 1 if file is created, otherwise returns 0.
+*/
+int writeMapFile(char *directoryName, struct world *aWorld, int sync) {
+    struct mapHeader header;
+    char fileName[STR];
+    char padding[8];
+    unsigned char *types = NULL;
+    uint32_t *names = NULL;
+    char *strings = NULL;
+    uint64_t stringSize = 0;
+    int i;
+    int fd;
+    int flag = 1;
+
+    /* stage the room types and the string table */
+    types = (unsigned char *)malloc(aWorld->roomCount);
+    assert(types != 0);
+    countAllocation();
+    names = (uint32_t *)malloc(aWorld->roomCount * sizeof(uint32_t));
+    assert(names != 0);
+    countAllocation();
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        types[i] = aWorld->list[i]->roomType;
+        names[i] = stringSize;
+        stringSize += strlen(aWorld->list[i]->name) + 1;
+    }
+    strings = (char *)malloc(stringSize);
+    assert(strings != 0);
+    countAllocation();
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        strcpy(strings + names[i], aWorld->list[i]->name);
+    }
+    /* lay out the sections */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_MAGIC, sizeof(header.magic));
+    header.version = MAP_VERSION;
+    header.roomCount = aWorld->roomCount;
+    header.edgeCount = aWorld->rowStart[aWorld->roomCount];
+    header.startRoom = aWorld->startRoom;
+    header.endRoom = aWorld->endRoom;
+    header.stringSize = stringSize;
+    header.typeOffset = sizeof(header);
+    header.nameOffset = alignOffset(header.typeOffset + aWorld->roomCount);
+    header.rowOffset = alignOffset(header.nameOffset + aWorld->roomCount * sizeof(uint32_t));
+    header.edgeOffset = alignOffset(header.rowOffset + (aWorld->roomCount + 1) * sizeof(uint32_t));
+    header.stringOffset = alignOffset(header.edgeOffset + header.edgeCount * sizeof(int32_t));
+    header.fileSize = header.stringOffset + stringSize;
+    /* write the sections in file order, zero padding up to each offset */
+    memset(padding, 0, sizeof(padding));
+    snprintf(fileName, STR, "%s/%s", directoryName, MAP_FILENAME);
+    fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        flag = 0;
+    } else {
+        flag = writeAll(fd, &header, sizeof(header))
+            && writeAll(fd, types, aWorld->roomCount)
+            && writeAll(fd, padding, header.nameOffset - (header.typeOffset + aWorld->roomCount))
+            && writeAll(fd, names, aWorld->roomCount * sizeof(uint32_t))
+            && writeAll(fd, padding, header.rowOffset - (header.nameOffset + aWorld->roomCount * sizeof(uint32_t)))
+            && writeAll(fd, aWorld->rowStart, (aWorld->roomCount + 1) * sizeof(uint32_t))
+            && writeAll(fd, padding, header.edgeOffset - (header.rowOffset + (aWorld->roomCount + 1) * sizeof(uint32_t)))
+            && writeAll(fd, aWorld->adjacent, header.edgeCount * sizeof(int32_t))
+            && writeAll(fd, padding, header.stringOffset - (header.edgeOffset + header.edgeCount * sizeof(int32_t)))
+            && writeAll(fd, strings, stringSize);
+        if (flag && sync && fsync(fd) == -1) {
+            flag = 0;
+        }
+        if (close(fd) == -1) {
+            flag = 0;
+        }
+    }
+    free(types);
+    free(names);
+    free(strings);
+    return flag;
+}
+
+
+/*
+Writes a whole buffer to a file descriptor, retrying short writes.
+Returns 1 if every byte was written, otherwise returns 0.
+*/
+int writeAll(int fd, void *data, size_t size) {
+    char *next = (char *)data;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, next, size);
+        if (written == -1) {
+            return 0;
+        }
+        next += written;
+        size -= written;
+    }
+    return 1;
+}
+
+
+/*
+Writes all of a buffer at an offset of a file, however many calls it takes.
+Returns 1 if everything is written, otherwise returns 0.
+*/
+int writeAt(int fd, void *data, size_t size, uint64_t offset) {
+    char *next = (char *)data;
+    ssize_t written;
+
+    while (size > 0) {
+        written = pwrite(fd, next, size, offset);
+        if (written == -1) {
+            return 0;
+        }
+        next += written;
+        offset += written;
+        size -= written;
+    }
+    return 1;
+}
+
+
+/*
+Rounds a file offset up to the next multiple of 8.
+*/
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+
+/*
+Generates a file path into a file name.
+file path will be in this format: dirName/Chamber_room
+*/
+void createFileName(char *fileName, char *directoryName, struct room *aRoom) {
+    char fowardSlash[2] = "/";
+    char suffix[6] = "_room";
+
+    /* copy directory name to file name */
+    strcpy(fileName, directoryName);
+    /* concatenate the forward slash */
+    strcat(fileName, fowardSlash);
+    /* concatenate the room name */
+    strcat(fileName, aRoom->name);
+    /* concatenate the suffix */
+    strcat(fileName, suffix);
+}
+
+
+/*
+    Writes the contents of a room to a specified I/O stream
+*/
+void writeOneRoom(FILE *stream, struct world *aWorld, struct room *aRoom) {
+    int j = 0;
+    int *connections = getConnections(aWorld, aRoom);
 
+    fprintf(stream, "ROOM NAME: %s\n", aRoom->name);
+    while (j < aRoom->connectCount) {
+        fprintf(stream, "CONNECTION %d: %s\n", (j + 1), aWorld->list[connections[j]]->name);
+        ++j;
+    }
+    fprintf (stream, "ROOM TYPE: %s\n", roomTypeNames[aRoom->roomType]);
+}
 
 
-int main() {
-    struct room **list = NULL;
-    char directoryName[STR] = "lindorg.rooms.";
-    int processID = getpid();
-    int exitStatus;
+/*
+Create all connection in graph
+When the random draws get stuck (the rooms with free slots are all connected
+already), the rooms still below the minimum are finished the constructive
+way, rewiring connections to make room for them.
+Returns 1 once every room has the minimum number of connections, or 0 if the
+connection bounds cannot be met.
+*/
+int createGraph(struct world *aWorld) {
+    struct roomSet open;
+    struct roomSet deficient;
+    int flag = 1;
+    int i;
 
-    srand(time(NULL));
-    /* initialize a list of rooms */
-    list = makeRoomList();
-    /* generate rooms and make connections */
-    makeRandomList(list);
-    createGraph(list); 
-    createStartAndEnd(list);
-    /* create directory */
-    exitStatus = makeDir(directoryName, processID);
-    if (exitStatus == -1) {
-        exit(EXIT_FAILURE);
+    makeEdgeSet(aWorld);
+    while (isGraphFull(aWorld) == 0) {
+        if (addRandomConnection(aWorld) == 0) {
+            makeRoomSet(&open, aWorld->roomCount);
+            makeRoomSet(&deficient, aWorld->roomCount);
+            for (i = 0; i < aWorld->roomCount; ++i) {
+                updateSets(aWorld, &open, &deficient, aWorld->list[i]);
+            }
+            flag = completeGraph(aWorld, &open, &deficient);
+            destroyRoomSet(&open);
+            destroyRoomSet(&deficient);
+            break;
+        }
     }
-   /* generate files in the directory */
-   if (writeFile(directoryName, list) == 0) {
-        exit(EXIT_FAILURE);
-   }
-   destroyList(list);
-   return 0;
+    destroyEdgeSet(aWorld);
+    return flag;
 }
 
+
 /*
- Randomly selects the start and end room of the seven selected rooms
+Create all connections without rejection sampling.  Room A is drawn from the
+rooms still below the minimum and room B from the rooms with a free slot, so
+every connection added moves the graph towards completion.  When no partner
+is left for A, an existing connection is rewired to make room for it.
+Returns 1 once every room has the minimum number of connections, or 0 if the
+connection bounds cannot be met (e.g. an odd total of connections).
 */
-void createStartAndEnd(struct room **list) {
-    char start[15] = "START_ROOM";
-    char end[15] = "END_ROOM";
-    int head = -1, tail = -1;
-
-    /* create random values for start and end */
-    head = rand() % SELECTED;
-    do {
-        tail = rand() % SELECTED;
-    } while (tail == head);
-    /* replace old strings with new strings*/
-    if (list[head]->roomType) {
-        free(list[head]->roomType);
-        list[head]->roomType = NULL;
-        list[head]->roomType = getString(start);
-    }    
-    if (list[tail]->roomType) {
-        free(list[tail]->roomType);
-        list[tail]->roomType = NULL;
-        list[tail]->roomType = getString(end);
-    }    
-}
-
-/*
-Copies a string from source to destination, but the new string is 
-dynamically allocated.
-*/
-char *getString(char *data) {
-    char *newStr = NULL;
-    int size = strlen(data) + 1;
-
-    if (size == 1) { return NULL; }
-    newStr = (char *)malloc(size * sizeof(char));
-    assert (newStr != 0);
-    strcpy(newStr, data);
-    return newStr;
+int createGraphConstructive(struct world *aWorld) {
+    struct roomSet open;
+    struct roomSet deficient;
+    int flag;
+
+    makeEdgeSet(aWorld);
+    makeRoomSet(&open, aWorld->roomCount);
+    makeRoomSet(&deficient, aWorld->roomCount);
+    flag = completeGraph(aWorld, &open, &deficient);
+    destroyRoomSet(&open);
+    destroyRoomSet(&deficient);
+    destroyEdgeSet(aWorld);
+    return flag;
 }
 
 
-/* Create a list of room struct pointers */
-struct room **makeRoomList() {
-    int index;
+/*
+Connects the rooms of the deficient set to rooms of the open set until no
+room is below the minimum, rewiring a connection when no partner is left.
+Returns 1 once the deficient set is empty, or 0 if the bounds cannot be met.
+*/
+int completeGraph(struct world *aWorld, struct roomSet *open, struct roomSet *deficient) {
+    struct room *A = NULL;
+    struct room *B = NULL;
+    int partner;
+    long rewires = 0;
+    long maxRewires = (long)aWorld->roomCount * aWorld->maxDegree;
 
-    struct room **list = (struct room **)malloc(SELECTED * sizeof(struct room*));
-    assert(list != 0);
-    for (index = 0; index < SELECTED; ++index) {
-        list[index] = NULL;
+    /* the product can pass INT_MAX on large maps; past the clamp it is no longer a useful bound */
+    if (maxRewires > MAX_REWIRES) {
+        maxRewires = MAX_REWIRES;
     }
-    return list;
+    while (deficient->count > 0) {
+        A = aWorld->list[deficient->members[randomBelow(&aWorld->rng, deficient->count)]];
+        partner = pickPartner(aWorld, open, A);
+        if (partner == -1) {
+            /* bounded so impossible bounds fail instead of spinning */
+            if (++rewires > maxRewires || rewireFor(aWorld, open, deficient, A) == 0) {
+                return 0;
+            }
+            ++aWorld->stats.rewires;
+            continue;
+        }
+        B = aWorld->list[partner];
+        connectRoom(aWorld, A, B);
+        connectRoom(aWorld, B, A);
+        updateSets(aWorld, open, deficient, A);
+        updateSets(aWorld, open, deficient, B);
+    }
+    return 1;
 }
 
 
-/* deallocate all memory from the list */
-void destroyList(struct room **list) {
-    int index;
-    int j;
-    if (list) {
-        for (index = 0; index < SELECTED; ++index) {
-            /* go through each index and remove all connections */
-            if (list[index] && list[index]->connections) {
-                for (j = 0; j < CONN_SZ; ++j) {
-                    if (list[index]->connections[j]) {
-                        list[index]->connections[j] = NULL;
-                    }
-                }
-            }
-            if (list[index]) {
-                /* delete name */
-                free(list[index]->name);
-                list[index]->name = NULL;
-                /* delete room type */
-                free(list[index]->roomType);
-                list[index]->roomType = NULL;
-                /* reset connection count */
-                list[index]->connectCount = 0;
-                /* delete room */
-                free(list[index]);
-                list[index] = NULL;
-            }
+/*
+Picks a room from the open set that room A can connect to.  A few random
+draws almost always succeed; otherwise the open set is scanned from a random
+point so the cost stays bounded by the size of the set.
+Returns the id of the partner, or -1 if no room in the open set qualifies.
+*/
+int pickPartner(struct world *aWorld, struct roomSet *open, struct room *roomA) {
+    int i;
+    int first;
+    struct room *B = NULL;
+
+    for (i = 0; i < PICK_TRIES; ++i) {
+        B = aWorld->list[open->members[randomBelow(&aWorld->rng, open->count)]];
+        if (isSameRoom(roomA, B) == 0 && connectionAlreadyExists(aWorld, roomA, B) == 0) {
+            return B->id;
+        }
+        ++aWorld->stats.pickRetries;
+    }
+    first = randomBelow(&aWorld->rng, open->count);
+    for (i = 0; i < open->count; ++i) {
+        B = aWorld->list[open->members[(first + i) % open->count]];
+        if (isSameRoom(roomA, B) == 0 && connectionAlreadyExists(aWorld, roomA, B) == 0) {
+            return B->id;
         }
-        /* delete list */
-        free(list);
-        list = NULL;
     }
+    return -1;
 }
 
 
 /*
-Creates a directory.
-Returns 0 is the directy is created, otherwise returns -1.
+Makes room for a connection from room A when every room with a free slot is
+already connected to it.  A connection C-D between two rooms not connected to
+A is removed and replaced by A-C, plus A-D if A still has a free slot.
+Groups cannot be split, so D may stay in C's group without a path to it;
+placeEnd only follows real connections, so the end room stays reachable.
+Returns 1 if a connection was rewired, otherwise returns 0.
 */
-int makeDir(char * directoryName, int pid) {
-    int flag = 0;
-    char pidStr[10];
+int rewireFor(struct world *aWorld, struct roomSet *open, struct roomSet *deficient, struct room *roomA) {
+    struct room *C = NULL;
+    struct room *D = NULL;
+    long tries;
+
+    for (tries = 0; tries < (long)aWorld->roomCount * PICK_TRIES; ++tries) {
+        C = getRandomRoom(aWorld);
+        if (C->connectCount == 0 || isSameRoom(roomA, C) || connectionAlreadyExists(aWorld, roomA, C)) {
+            continue;
+        }
+        D = aWorld->list[getConnections(aWorld, C)[randomBelow(&aWorld->rng, C->connectCount)]];
+        if (isSameRoom(roomA, D)) {
+            continue;
+        }
+        disconnectRoom(aWorld, C, D);
+        disconnectRoom(aWorld, D, C);
+        connectRoom(aWorld, roomA, C);
+        connectRoom(aWorld, C, roomA);
+        if (canAddConnectionFrom(aWorld, roomA) && connectionAlreadyExists(aWorld, roomA, D) == 0) {
+            connectRoom(aWorld, roomA, D);
+            connectRoom(aWorld, D, roomA);
+        }
+        updateSets(aWorld, open, deficient, roomA);
+        updateSets(aWorld, open, deficient, C);
+        updateSets(aWorld, open, deficient, D);
+        return 1;
+    }
+    return 0;
+}
 
-    memset(pidStr, '\0', 10);
 
-    /* change pid to to string */
-    flag = snprintf(pidStr, 10, "%d", pid);
-    /* concatenate pid string to directory name */
-    if (flag > 0) {
-        strcat(directoryName, pidStr);
-        /* create the directory */
-        flag = mkdir(directoryName, 0755);
-     } else {
-         flag = -1;
-     }
-    return flag;
+/*
+Keeps a room's membership of the open and deficient sets in line with its
+connection count.
+*/
+void updateSets(struct world *aWorld, struct roomSet *open, struct roomSet *deficient, struct room *aRoom) {
+    if (canAddConnectionFrom(aWorld, aRoom)) {
+        addToSet(open, aRoom->id);
+    } else {
+        removeFromSet(open, aRoom->id);
+    }
+    if (aRoom->connectCount < aWorld->minDegree) {
+        addToSet(deficient, aRoom->id);
+    } else {
+        removeFromSet(deficient, aRoom->id);
+    }
 }
 
 
 /*
-writes seven files to a specific directory
-Returns 1 if file is created, otherwise returns 0.
+Creates a set holding every room of the world.
 */
-int writeFile(char *directoryName, struct room **list) {
-    int flag = 1;
-    char fileName[STR];
+void makeRoomSet(struct roomSet *set, int roomCount) {
     int i;
-    FILE *aFile;
 
-    memset(fileName, '\0', STR);
-    /* for each room */
-    for ( i = 0; i < SELECTED; ++i) {
-        /* create the file name */
-        createFileName(fileName, directoryName, list[i]);
-        /* open a file */
-        aFile = fopen(fileName, "w");
-        if (aFile) {
-        /* write room contents to a file */
-            writeOneRoom(aFile, list[i]);
-        } else {
-            flag = 0;
-            break;
-        }
-        /* close file */
-        fclose(aFile);
-        memset(fileName, '\0', STR);
+    set->members = (int *)malloc(roomCount * sizeof(int));
+    assert(set->members != 0);
+    countAllocation();
+    set->position = (int *)malloc(roomCount * sizeof(int));
+    assert(set->position != 0);
+    countAllocation();
+    for (i = 0; i < roomCount; ++i) {
+        set->members[i] = i;
+        set->position[i] = i;
     }
-    return flag;
+    set->count = roomCount;
 }
 
 
 /*
-Generates a file path into a file name.
-file path will be in this format: dirName/Chamber_room
+Deallocates the arrays of a room set.
 */
-void createFileName(char *fileName, char *directoryName, struct room *aRoom) {
-    char fowardSlash[2] = "/";
-    char suffix[6] = "_room";
-    
-    /* copy directory name to file name */
-    strcpy(fileName, directoryName);
-    /* concatenate the forward slash */
-    strcat(fileName, fowardSlash);
-    /* concatenate the room name */
-    strcat(fileName, aRoom->name); 
-    /* concatenate the suffix */
-    strcat(fileName, suffix); 
+void destroyRoomSet(struct roomSet *set) {
+    free(set->members);
+    set->members = NULL;
+    free(set->position);
+    set->position = NULL;
+    set->count = 0;
 }
 
 
 /*
-    Writes the contents of a room to a specified I/O stream
+Adds a room to a set, does nothing if the room is already in it.
 */
-void writeOneRoom(FILE *stream,struct room *aRoom) {
-    int j = 0;
-
-    fprintf(stream, "ROOM NAME: %s\n", aRoom->name);
-    while (aRoom->connections[j] && j < aRoom->connectCount) {
-        fprintf(stream, "CONNECTION %d: %s\n", (j + 1), aRoom->connections[j]->name);
-        ++j;
+void addToSet(struct roomSet *set, int id) {
+    if (set->position[id] == -1) {
+        set->members[set->count] = id;
+        set->position[id] = set->count;
+        ++set->count;
     }
-    fprintf (stream, "ROOM TYPE: %s\n", aRoom->roomType);
 }
 
 
 /*
-Create all connection in graph
+Removes a room from a set by moving the last member into its place.
 */
-void createGraph(struct room **list) {
-    while (isGraphFull(list) == 0) {
-        addRandomConnection(list); 
+void removeFromSet(struct roomSet *set, int id) {
+    int index = set->position[id];
+    int last;
+
+    if (index != -1) {
+        last = set->members[set->count - 1];
+        set->members[index] = last;
+        set->position[last] = index;
+        set->position[id] = -1;
+        --set->count;
     }
 }
 
 
 /*
-Return 1 if all rooms have 3 to 6 outbound connections, otherwise returns 0
+Return 1 if all rooms have the minimum number of outbound connections, otherwise returns 0
+The rooms below the minimum are counted as connections come and go, so no
+room is visited.
 */
-int  isGraphFull(struct room **list) {
+int  isGraphFull(struct world *aWorld) {
     int flag = 1;
-    int index = 0;
 
-    assert(list != 0);
-    while (index < SELECTED && flag ) {
-        if (!list[index]) {
-            flag = 0;
-        } else if (list[index]->connectCount < MIN){
-            flag = 0;
-        } 
-        ++index;
+    if (aWorld->deficientRooms > 0) {
+        flag = 0;
     }
     return flag;
 }
@@ -303,119 +2382,349 @@ int  isGraphFull(struct room **list) {
 
 /*
 Adds a random, valid outbound connection from a Room to another Room
+The draws are bounded: a valid room is found long before the bound unless
+there is none left, and createGraph finishes the graph without random draws
+past it, so the bound only has to be a few passes over the rooms.
+Returns 1 if a connection is added, otherwise returns 0.
 */
-void addRandomConnection(struct room **list) {
+int addRandomConnection(struct world *aWorld) {
     struct room *A = NULL;
     struct room *B = NULL;
+    long tries = 0;
+    long maxTries = (long)aWorld->roomCount * PICK_TRIES;
 
     while (1) {
-        /* retrieve room A and see if there can be a connection */ 
-        A = getRandomRoom(list);
-        if  (canAddConnectionFrom(A)) {
+        /* retrieve room A and see if there can be a connection */
+        A = getRandomRoom(aWorld);
+        if  (canAddConnectionFrom(aWorld, A)) {
             break;
         }
+        ++aWorld->stats.pickRetries;
+        if (++tries > maxTries) {
+            return 0;
+        }
     }
-    do {
+    tries = 0;
+    while (1) {
         /* retrieve room B */
-        B = getRandomRoom(list);
-    } while (canAddConnectionFrom(B)== 0 || isSameRoom(A, B) == 1 || connectionAlreadyExists(A, B) == 1);
-    connectRoom(A, B);
-    connectRoom(B, A);
+        B = getRandomRoom(aWorld);
+        if (canAddConnectionFrom(aWorld, B) && isSameRoom(A, B) == 0 && connectionAlreadyExists(aWorld, A, B) == 0) {
+            break;
+        }
+        ++aWorld->stats.pickRetries;
+        if (++tries > maxTries) {
+            return 0;
+        }
+    }
+    connectRoom(aWorld, A, B);
+    connectRoom(aWorld, B, A);
+    return 1;
+}
+
+
+/*
+Returns the first connection of a room.  The room's connections are the next
+connectCount entries.
+*/
+int *getConnections(struct world *aWorld, struct room *aRoom) {
+    if (aWorld->rowStart) {
+        return aWorld->adjacent + aWorld->rowStart[aRoom->id];
+    }
+    return aWorld->adjacent + (size_t)aRoom->id * aWorld->maxDegree;
+}
+
+
+/*
+Packs the fixed connection slots into CSR form once the graph is complete.
+Each room's connections are moved down to follow the previous room's, which
+is safe in place because a room never moves past its own slots.  The unused
+tail stays in the arena until the world is destroyed.
+*/
+void compactGraph(struct world *aWorld) {
+    int i;
+    int offset = 0;
+    int *source;
+
+    aWorld->rowStart = (int *)arenaAlloc(&aWorld->memory, (aWorld->roomCount + 1) * sizeof(int));
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        source = aWorld->adjacent + (size_t)i * aWorld->maxDegree;
+        aWorld->rowStart[i] = offset;
+        memmove(aWorld->adjacent + offset, source, aWorld->list[i]->connectCount * sizeof(int));
+        offset += aWorld->list[i]->connectCount;
+    }
+    aWorld->rowStart[aWorld->roomCount] = offset;
 }
 
 
 /*
-    Verifies that all selected rooms in a list are unique.
+    Verifies that a room name is not used yet by looking it up in the hash set
+    of used names.  A name that is not found is added to the set.
     Returns 0 if no duplication found, otherwise returns 1
 */
-int duplicateRooms(struct room **list, char *search) {
-    int i = 0;
-    int found = 0;
+int duplicateRooms(struct nameSet *used, char *search) {
+    char **slot = findName(used, search);
+
+    if (*slot) {
+        return 1;
+    }
+    *slot = search;
+    return 0;
+}
 
-    while (i < SELECTED && list[i]->name && !found) {
-        if (!strcmp(list[i]->name, search)) {
-            found = 1;
+
+/*
+    Returns the slot of the hash set that holds a name, or the empty slot
+    where the name belongs if it is not in the set.
+*/
+char **findName(struct nameSet *used, char *search) {
+    unsigned int slot = hashName(search) & used->mask;
+
+    while (used->slots[slot] && strcmp(used->slots[slot], search)) {
+        slot = (slot + 1) & used->mask;
+    }
+    return &used->slots[slot];
+}
+
+
+/*
+    Names every room of the world.  The first rooms take distinct words from
+    the name pool with a partial Fisher-Yates shuffle, so each pick costs one
+    swap instead of a retry loop.  Once the pool runs out, the remaining rooms
+    get a random word plus a random number; the number range is at least four
+    times the names needed, so a name is rarely drawn twice.
+*/
+void roomBank(struct world *aWorld, struct namePool *pool) {
+    struct nameSet used;
+    char **order = NULL;
+    char *swap = NULL;
+    char **slot = NULL;
+    char numbered[STR];
+    int i, j;
+    int picked = aWorld->roomCount < pool->count ? aWorld->roomCount : pool->count;
+    int range = 4 * (aWorld->roomCount / pool->count) + 16;
+
+    makeNameSet(&used, aWorld->roomCount);
+    order = (char **)malloc(pool->count * sizeof(char *));
+    assert(order != 0);
+    countAllocation();
+    memcpy(order, pool->words, pool->count * sizeof(char *));
+    /* shuffle only as many words as there are rooms */
+    for (i = 0; i < picked; ++i) {
+        j = i + randomBelow(&aWorld->rng, pool->count - i);
+        swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+        aWorld->list[i]->name = arenaString(&aWorld->memory, order[i]);
+        duplicateRooms(&used, aWorld->list[i]->name);
+    }
+    for (i = picked; i < aWorld->roomCount; ++i) {
+        /* a repeat is drawn again before anything is copied */
+        do {
+            snprintf(numbered, STR, "%s%d", pool->words[randomBelow(&aWorld->rng, pool->count)],
+                     randomBelow(&aWorld->rng, range) + 1);
+            slot = findName(&used, numbered);
+            aWorld->stats.nameRetries += (*slot != NULL);
+        } while (*slot);
+        aWorld->list[i]->name = arenaString(&aWorld->memory, numbered);
+        *slot = aWorld->list[i]->name;
+    }
+    free(order);
+    destroyNameSet(&used);
+}
+
+
+/*
+    Reads a dictionary file into a name pool, one name per line.  Blank lines,
+    repeated names and names that cannot be used in a file name are skipped.
+    Returns 1 if the file holds at least one name, otherwise returns 0.
+*/
+int loadNamePool(struct namePool *pool, char *fileName) {
+    FILE *reader;
+    struct stat attributes;
+    struct nameSet seen;
+    char *line = NULL;
+    char *next = NULL;
+    size_t size;
+    int capacity = 0;
+
+    pool->count = 0;
+    pool->words = NULL;
+    pool->text = NULL;
+    reader = fopen(fileName, "r");
+    if (!reader) {
+        return 0;
+    }
+    if (fstat(fileno(reader), &attributes) == -1) {
+        fclose(reader);
+        return 0;
+    }
+    /* read the whole dictionary at once, the words point into this copy */
+    size = attributes.st_size;
+    pool->text = (char *)malloc(size + 1);
+    assert(pool->text != 0);
+    size = fread(pool->text, 1, size, reader);
+    pool->text[size] = '\0';
+    fclose(reader);
+    /* one word per line, so there are at most as many words as newlines + 1 */
+    for (line = pool->text; *line; ++line) {
+        if (*line == '\n') { ++capacity; }
+    }
+    ++capacity;
+    pool->words = (char **)malloc(capacity * sizeof(char *));
+    assert(pool->words != 0);
+    makeNameSet(&seen, capacity);
+    for (line = pool->text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next = '\0';
+            ++next;
         }
-        ++i;
+        /* tolerate files with DOS line endings */
+        size = strlen(line);
+        if (size > 0 && line[size - 1] == '\r') {
+            line[size - 1] = '\0';
+        }
+        if (isValidName(line) && duplicateRooms(&seen, line) == 0) {
+            pool->words[pool->count] = line;
+            ++pool->count;
+        }
+    }
+    destroyNameSet(&seen);
+    if (pool->count == 0) {
+        destroyNamePool(pool);
+        return 0;
     }
-    return found;
+    return 1;
 }
 
 
 /*
-    Randomly selects one room from the room word bank (10 rooms).
-    Returns the name of the selected room.
-    The function also verifies that the room selected from word bank is not
-    on the selected rooms list.
+    Fills a name pool with the built-in word bank (10 rooms).
 */
-char *roomBank(struct room **list) {
-    char *selected = NULL;
-    int value = -1;
-    char *wordBank[10] = { "Gallery", "Ballroom", "Billiard"
-                            , "Library", "Office", "Armory"
-                            , "Stables", "Chambers", "Kitchen", "Theater" };
-    /* generate a random value within the range of wordBank array */
-    do { 
-        value = rand() % SIZE;
-    } while( duplicateRooms(list, wordBank[value])); 
-    /* copy random string to selected string */
-    selected = (char *) malloc (NAME_SZ * sizeof(char));
-    assert(selected != 0);
-    strcpy(selected, wordBank[value]);
-    return selected;
+void defaultNamePool(struct namePool *pool) {
+    pool->count = SIZE;
+    pool->words = (char **)malloc(SIZE * sizeof(char *));
+    assert(pool->words != 0);
+    memcpy(pool->words, wordBank, SIZE * sizeof(char *));
+    pool->text = NULL;
 }
 
 
 /*
-    Generates a random list of seven selected rooms
+    Deallocates a name pool.
 */
-void makeRandomList(struct room **list) {
+void destroyNamePool(struct namePool *pool) {
+    free(pool->words);
+    pool->words = NULL;
+    free(pool->text);
+    pool->text = NULL;
+    pool->count = 0;
+}
+
+
+/*
+    Returns 1 if a word can be a room name: letters, digits, '-' and '_' only,
+    at most NAME_LEN characters, and not a word the game reserves as a command.
+    Otherwise returns 0.
+*/
+int isValidName(char *word) {
     int i;
-    int j;
+
+    for (i = 0; i < RESERVED_WORDS; ++i) {
+        if (strcmp(word, reservedWords[i]) == 0) {
+            return 0;
+        }
+    }
+    for (i = 0; word[i]; ++i) {
+        if (i == NAME_LEN || !(isalnum((unsigned char)word[i]) || word[i] == '-' || word[i] == '_')) {
+            return 0;
+        }
+    }
+    return i > 0;
+}
+
+
+/*
+    Creates an empty name set with room for at least twice the expected names.
+*/
+void makeNameSet(struct nameSet *set, int expected) {
+    unsigned int capacity = 16;
+
+    while (capacity < 2 * (unsigned int)expected) {
+        capacity *= 2;
+    }
+    set->slots = (char **)calloc(capacity, sizeof(char *));
+    assert(set->slots != 0);
+    countAllocation();
+    set->mask = capacity - 1;
+}
+
+
+/*
+    Deallocates a name set, the names themselves are not freed.
+*/
+void destroyNameSet(struct nameSet *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->mask = 0;
+}
+
+
+/*
+    Returns the FNV-1a hash of a name.
+*/
+unsigned int hashName(char *name) {
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+        ++name;
+    }
+    return hash;
+}
+
+
+/*
+    Generates a random list of selected rooms
+*/
+void makeRandomList(struct world *aWorld, struct namePool *pool) {
+    int i;
+    struct room **list = aWorld->list;
 
     /* loop through each element of list and generate a random room */
-    for (i = 0; i < SELECTED; ++i) {
-        list[i] = (struct room*)malloc(sizeof(struct room));
-        assert(list[i] != 0); 
-        list[i]->name = roomBank(list); 
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        list[i]->name = NULL;
         list[i]->id = i;
-        /* allocate the six connections */
-        list[i]->connections = (struct room **)malloc(CONN_SZ * sizeof(struct room*));
-        assert(list[i]->connections != 0); 
-        for (j = 0; j < CONN_SZ; ++j) {
-            list[i]->connections[j] = NULL;
-        }
         /* initialize connection count and room type */
         list[i]->connectCount = 0;
-        list[i]->roomType = NULL;
-        list[i]->roomType = (char *)malloc(NAME_SZ * sizeof(char));
-        assert(list[i]->roomType != 0);
-        strcpy(list[i]->roomType, "MID_ROOM");
+        list[i]->roomType = MID_ROOM;
     }
+    roomBank(aWorld, pool);
 }
 
 
 /*
 Returns a random Room, does NOT validate if connection can be added
 */
-struct room *getRandomRoom(struct room **list) {
+struct room *getRandomRoom(struct world *aWorld) {
     int roomIndex;
 
     /* get random index for list */
-    roomIndex = rand() % SELECTED;
-    assert(roomIndex > -1 && roomIndex < SELECTED);
-    return  list[roomIndex];
+    roomIndex = randomBelow(&aWorld->rng, aWorld->roomCount);
+    assert(roomIndex > -1 && roomIndex < aWorld->roomCount);
+    return  aWorld->list[roomIndex];
 }
 
 
 
 /*
-Returns 0 if a connection can be added from Room x ( < 6 outbound connections), otherwise returns 0
+Returns 1 if a connection can be added from Room x ( < max outbound connections), otherwise returns 0
 */
-int canAddConnectionFrom(struct room *roomX) {
+int canAddConnectionFrom(struct world *aWorld, struct room *roomX) {
     int flag = 0;
 
-    if (roomX->connectCount < CONN_SZ) {
+    if (roomX->connectCount < aWorld->maxDegree) {
         flag = 1;
      }
 
@@ -423,15 +2732,26 @@ int canAddConnectionFrom(struct room *roomX) {
 }
 
 
-/* 
+/*
 Returns 1 if a connection from Room x to Room y already exists, otherwise returns 0
+The edge set answers in constant time; the hash set holds room pairs, which
+is enough because connections are always added and removed both ways.
 */
-int connectionAlreadyExists(struct room *roomX, struct room *roomY) {
+int connectionAlreadyExists(struct world *aWorld, struct room *roomX, struct room *roomY) {
     int flag = 0;
     int i;
+    int *connections = getConnections(aWorld, roomX);
+    uint64_t bit;
 
+    if (aWorld->edges.kind == EDGE_BITS) {
+        bit = (uint64_t)roomX->id * aWorld->roomCount + roomY->id;
+        return (aWorld->edges.words[bit >> 6] >> (bit & 63)) & 1;
+    }
+    if (aWorld->edges.kind == EDGE_HASH) {
+        return *findEdge(aWorld, edgeKey(roomX->id, roomY->id)) != 0;
+    }
     for (i = 0; i < roomX->connectCount; ++i) {
-        if (roomX->connections[i]->id == roomY->id) {
+        if (connections[i] == roomY->id) {
             flag = 1;
             break;
         }
@@ -441,15 +2761,189 @@ int connectionAlreadyExists(struct room *roomX, struct room *roomY) {
 
 
 /*
-Connect Rooms x and y together, does not check if this connection is valid
+Sets up the edge set of a world for building its graph, from the connections
+it already has, and counts the rooms below the minimum.  The kind of set
+depends on the size of the world and its connection bounds (see struct
+edgeSet).
 */
-void connectRoom( struct room *roomX, struct room *roomY) {
+void makeEdgeSet(struct world *aWorld) {
+    struct edgeSet *edges = &aWorld->edges;
+    uint64_t rooms = aWorld->roomCount;
+    uint64_t size;
+    int i, j;
+    int *connections;
+
+    if (aWorld->maxDegree <= EDGE_SCAN_DEGREE) {
+        edges->kind = EDGE_SCAN;
+        size = 0;
+    } else if (rooms * rooms / 8 <= EDGE_BITS_LIMIT) {
+        edges->kind = EDGE_BITS;
+        size = (rooms * rooms + 63) / 64;
+    } else {
+        /* at most half full: every pair is counted once */
+        edges->kind = EDGE_HASH;
+        for (size = 16; size < rooms * aWorld->maxDegree; size *= 2) {
+        }
+        edges->mask = size - 1;
+    }
+    edges->words = NULL;
+    if (size > 0) {
+        edges->words = (uint64_t *)calloc(size, sizeof(uint64_t));
+        assert(edges->words != 0);
+        countAllocation();
+    }
+    aWorld->deficientRooms = 0;
+    for (i = 0; i < aWorld->roomCount; ++i) {
+        connections = getConnections(aWorld, aWorld->list[i]);
+        for (j = 0; j < aWorld->list[i]->connectCount; ++j) {
+            addEdge(aWorld, i, connections[j]);
+        }
+        if (aWorld->list[i]->connectCount < aWorld->minDegree) {
+            ++aWorld->deficientRooms;
+        }
+    }
+}
+
+
+/*
+Frees the edge set once the graph is built; later checks scan the rooms.
+*/
+void destroyEdgeSet(struct world *aWorld) {
+    free(aWorld->edges.words);
+    aWorld->edges.words = NULL;
+    aWorld->edges.kind = EDGE_SCAN;
+}
+
+
+/*
+Records a connection from room x to room y in the edge set.
+*/
+void addEdge(struct world *aWorld, int idX, int idY) {
+    uint64_t bit;
+    uint64_t key;
+    uint64_t *slot;
+
+    if (aWorld->edges.kind == EDGE_BITS) {
+        bit = (uint64_t)idX * aWorld->roomCount + idY;
+        aWorld->edges.words[bit >> 6] |= (uint64_t)1 << (bit & 63);
+    } else if (aWorld->edges.kind == EDGE_HASH) {
+        key = edgeKey(idX, idY);
+        slot = findEdge(aWorld, key);
+        *slot = key;
+    }
+}
+
+
+/*
+Removes a connection from room x to room y from the edge set.  A hash slot
+is emptied by moving later entries of its probe sequence back, so lookups
+never need tombstones.
+*/
+void removeEdge(struct world *aWorld, int idX, int idY) {
+    uint64_t *words = aWorld->edges.words;
+    uint64_t mask = aWorld->edges.mask;
+    uint64_t bit, hole, next, home;
+
+    if (aWorld->edges.kind == EDGE_BITS) {
+        bit = (uint64_t)idX * aWorld->roomCount + idY;
+        words[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+        return;
+    }
+    if (aWorld->edges.kind != EDGE_HASH) {
+        return;
+    }
+    hole = findEdge(aWorld, edgeKey(idX, idY)) - words;
+    if (words[hole] == 0) {
+        return;
+    }
+    for (next = (hole + 1) & mask; words[next] != 0; next = (next + 1) & mask) {
+        home = hashEdge(words[next]) & mask;
+        /* an entry whose home lies cyclically in (hole, next] must stay */
+        if (hole <= next ? (home <= hole || home > next) : (home <= hole && home > next)) {
+            words[hole] = words[next];
+            hole = next;
+        }
+    }
+    words[hole] = 0;
+}
+
+
+/*
+Returns the hash slot holding a room pair, or the empty slot where it would
+go.
+*/
+uint64_t *findEdge(struct world *aWorld, uint64_t key) {
+    uint64_t *words = aWorld->edges.words;
+    uint64_t mask = aWorld->edges.mask;
+    uint64_t slot = hashEdge(key) & mask;
+
+    while (words[slot] != 0 && words[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return words + slot;
+}
+
+
+/*
+Returns the key of the pair of rooms x and y, the same both ways.  A room is
+never connected to itself, so no key is 0.
+*/
+uint64_t edgeKey(int idX, int idY) {
+    if (idX > idY) {
+        return ((uint64_t)idY << 32) | (uint32_t)idX;
+    }
+    return ((uint64_t)idX << 32) | (uint32_t)idY;
+}
+
+
+/*
+    Returns a mixed hash of an edge key (the splitmix64 finalizer).
+*/
+uint64_t hashEdge(uint64_t key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+
+/*
+Connect Rooms x and y together, does not check if this connection is valid.
+The groups of the two rooms are merged, and the edge set and the count of
+rooms below the minimum are kept up to date.
+*/
+void connectRoom(struct world *aWorld, struct room *roomX, struct room *roomY) {
     int index = roomX->connectCount;
-    assert (index < (CONN_SZ + 1));
+    assert (index < (aWorld->maxDegree + 1));
 
-    if (!roomX->connections[index] && roomX->connectCount < CONN_SZ) {
-        roomX->connections[index] = roomY;
+    if (roomX->connectCount < aWorld->maxDegree) {
+        getConnections(aWorld, roomX)[index] = roomY->id;
         ++roomX->connectCount;
+        joinGroups(aWorld, roomX->id, roomY->id);
+        addEdge(aWorld, roomX->id, roomY->id);
+        if (roomX->connectCount == aWorld->minDegree) {
+            --aWorld->deficientRooms;
+        }
+    }
+}
+
+
+/*
+Removes the connection from Room x to Room y, the last connection of x takes its slot
+*/
+void disconnectRoom(struct world *aWorld, struct room *roomX, struct room *roomY) {
+    int i;
+    int *connections = getConnections(aWorld, roomX);
+
+    for (i = 0; i < roomX->connectCount; ++i) {
+        if (connections[i] == roomY->id) {
+            if (roomX->connectCount == aWorld->minDegree) {
+                ++aWorld->deficientRooms;
+            }
+            connections[i] = connections[roomX->connectCount - 1];
+            --roomX->connectCount;
+            removeEdge(aWorld, roomX->id, roomY->id);
+            break;
+        }
     }
 }
 
@@ -465,4 +2959,3 @@ int isSameRoom(struct room *roomX, struct room *roomY) {
     }
     return flag;
 }
-